@@ -1193,6 +1193,57 @@ out:
 	return count;
 }
 
+/* A co-source that finished early stays part of its multi-source resync
+ * until the last one finishes, see drbd_resync_finished(). What the others
+ * still deliver is in sync with it as well. */
+bool drbd_rs_co_source_of_round(struct drbd_peer_device *peer_device)
+{
+	return is_rs_co_source(peer_device, NOW) ||
+		(drbd_multi_source_resync &&
+		 (peer_device->device->rs_co_sources_done & NODE_MASK(peer_device->node_id)) &&
+		 peer_device->disk_state[NOW] == D_UP_TO_DATE &&
+		 peer_device->repl_state[NOW] == L_ESTABLISHED);
+}
+
+static void rs_change_co_sources(struct drbd_peer_device *peer_device, sector_t sector, int size,
+				 enum update_sync_bits_mode mode)
+{
+	struct drbd_peer_device *p;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, peer_device->device) {
+		if (p != peer_device && drbd_rs_co_source_of_round(p))
+			__drbd_change_sync(p, sector, size, mode);
+	}
+	rcu_read_unlock();
+}
+
+/* Resync data from one up-to-date peer is in sync with all of them,
+ * clear the bits for all co-sources of a multi-source resync. */
+void drbd_rs_set_in_sync(struct drbd_peer_device *peer_device, sector_t sector, int size)
+{
+	drbd_set_in_sync(peer_device, sector, size);
+
+	if (!is_rs_co_source(peer_device, NOW) ||
+	    test_bit(UNSTABLE_RESYNC, &peer_device->flags))
+		return;
+
+	rs_change_co_sources(peer_device, sector, size, SET_IN_SYNC);
+}
+
+/* A block that failed was not written, whichever co-source it came from.
+ * Record it with all of them, so that none of them declares the resync
+ * done while the bit is still set in its slot. */
+void drbd_rs_set_failed(struct drbd_peer_device *peer_device, sector_t sector, int size)
+{
+	drbd_rs_failed_io(peer_device, sector, size);
+
+	if (!is_rs_co_source(peer_device, NOW))
+		return;
+
+	rs_change_co_sources(peer_device, sector, size, RECORD_RS_FAILED);
+}
+
 bool drbd_set_all_out_of_sync(struct drbd_device *device, sector_t sector, int size)
 {
 	return drbd_set_sync(device, sector, size, -1, -1);
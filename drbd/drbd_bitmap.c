@@ -1539,6 +1539,62 @@ int drbd_bm_test_bit(struct drbd_peer_device *peer_device, const unsigned long b
 	return ret;
 }
 
+/* returns the number of consecutive set bits starting at bitnr, at most max.
+ * One bm_lock round trip, instead of one drbd_bm_test_bit() per bit.
+ * Same caveats as for drbd_bm_test_bit(), and
+ * -1 ... bitnr is out of bounds
+ */
+int drbd_bm_run_length(struct drbd_peer_device *peer_device, const unsigned long bitnr,
+		       unsigned int max)
+{
+	struct drbd_bitmap *bitmap = peer_device->device->bitmap;
+	unsigned long irq_flags;
+	unsigned long end, zero;
+	int ret;
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	if (bitnr >= bitmap->bm_bits) {
+		ret = -1;
+	} else if (max == 0) {
+		ret = 0;
+	} else {
+		end = min(bitnr + max, bitmap->bm_bits);
+		zero = __bm_op(peer_device->device, peer_device->bitmap_index, bitnr, end - 1,
+			       BM_OP_FIND_ZERO_BIT, NULL);
+		ret = (zero == DRBD_END_OF_BITMAP ? end : zero) - bitnr;
+	}
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	return ret;
+}
+
+/* finds the next set bit at or after start, like drbd_bm_find_next(), and
+ * copies the nr_bits aligned window of the bitmap that contains it into
+ * buffer, in the same bm_lock round trip.  nr_bits must be a power of two,
+ * and a multiple of BITS_PER_LONG.
+ * buffer[i] will be little endian unsigned long; bits beyond the end of the
+ * bitmap are zero.  If no bit is found, buffer is left alone.
+ */
+unsigned long drbd_bm_find_next_window(struct drbd_peer_device *peer_device, unsigned long start,
+				       unsigned long *buffer, unsigned long nr_bits)
+{
+	struct drbd_device *device = peer_device->device;
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long irq_flags;
+	unsigned long bit, first, last;
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	bit = __bm_op(device, peer_device->bitmap_index, start, -1UL, BM_OP_FIND_BIT, NULL);
+	if (bit != DRBD_END_OF_BITMAP) {
+		first = bit & ~(nr_bits - 1);
+		last = min(first + nr_bits, bitmap->bm_bits) - 1;
+		memset(buffer, 0, nr_bits / 8);
+		__bm_op(device, peer_device->bitmap_index, first, last, BM_OP_EXTRACT,
+			(__le32 *)buffer);
+	}
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	return bit;
+}
+
 /* returns number of bits set in the range [s, e] */
 int drbd_bm_count_bits(struct drbd_device *device, unsigned int bitmap_index, unsigned long s, unsigned long e)
 {
@@ -0,0 +1,358 @@
+/*
+   drbd_csum_cache.c
+
+   This file is part of DRBD.
+
+   Digests of block ranges of the local backing device, as calculated for
+   checksum based resync and online verify.  As long as a range was not
+   written since, a later checksum based resync can use the cached digest
+   instead of reading and hashing the range again.  Online verify only
+   fills the cache: it has to read the media, to find what changed there
+   without DRBD knowing.
+
+   Entries are dropped when a write to the range completes, both for
+   application writes and for writes on behalf of a peer.  The cache lives
+   in memory only, from attach to detach of the backing device.
+
+   It is not kept in the meta data area.  That would need space for it in
+   the on-disk layout, which drbdmeta creates and which is not part of this
+   tree.  After a crash it would also have to drop every entry in an extent
+   of the activity log, because writes to those may have reached the disk
+   without their completion ever being seen here.  So after a restart, the
+   first resync reads everything, as without the cache.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   drbd is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with drbd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <crypto/hash.h>
+#include "drbd_int.h"
+
+/* Writes are tracked per chunk of 1 MiB, a cached range never crosses
+ * a chunk boundary.  Each hash bucket has a sequence number, bumped by every
+ * write to one of its chunks, to detect writes that completed while the
+ * digest was calculated. */
+#define CSUM_CACHE_CHUNK_SHIFT	11	/* in sectors */
+#define CSUM_CACHE_MAX_ALGS	4
+
+struct csum_cache_entry {
+	struct hlist_node hash;
+	struct list_head lru;
+	sector_t sector;
+	unsigned int size;
+	u8 alg;		/* index into drbd_csum_cache.algs */
+	u8 digest_size;
+	u8 digest[CSUM_CACHE_MAX_DIGEST];
+};
+
+struct drbd_csum_cache {
+	spinlock_t lock;
+	unsigned int bucket_mask;
+	unsigned int max_entries;
+	unsigned int nr_entries;
+	struct list_head lru;	/* most recently used first */
+	unsigned int nr_algs;
+	char algs[CSUM_CACHE_MAX_ALGS][CRYPTO_MAX_ALG_NAME];
+	u64 hits;
+	u64 misses;
+	u64 dropped;
+	atomic_t *seq;
+	struct hlist_head *buckets;
+};
+
+static unsigned int csum_cache_bucket(struct drbd_csum_cache *cache, sector_t sector)
+{
+	return (sector >> CSUM_CACHE_CHUNK_SHIFT) & cache->bucket_mask;
+}
+
+static void csum_cache_free_entry(struct drbd_csum_cache *cache, struct csum_cache_entry *e)
+{
+	hlist_del(&e->hash);
+	list_del(&e->lru);
+	cache->nr_entries--;
+	kfree(e);
+}
+
+static void csum_cache_flush(struct drbd_csum_cache *cache)
+{
+	struct csum_cache_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &cache->lru, lru)
+		csum_cache_free_entry(cache, e);
+	cache->nr_algs = 0;
+}
+
+/* Returns the index of the algorithm of @tfm, or -1.  With @add, an unknown
+ * algorithm gets a new index; if all are in use, the cache starts over. */
+static int csum_cache_alg(struct drbd_csum_cache *cache, struct crypto_ahash *tfm, bool add)
+{
+	const char *name = crypto_tfm_alg_name(crypto_ahash_tfm(tfm));
+	unsigned int i;
+
+	for (i = 0; i < cache->nr_algs; i++)
+		if (!strcmp(cache->algs[i], name))
+			return i;
+	if (!add)
+		return -1;
+	if (cache->nr_algs == CSUM_CACHE_MAX_ALGS)
+		csum_cache_flush(cache);
+	strlcpy(cache->algs[cache->nr_algs], name, CRYPTO_MAX_ALG_NAME);
+	return cache->nr_algs++;
+}
+
+static struct csum_cache_entry *
+csum_cache_find(struct drbd_csum_cache *cache, int alg, sector_t sector, unsigned int size)
+{
+	struct csum_cache_entry *e;
+
+	hlist_for_each_entry(e, &cache->buckets[csum_cache_bucket(cache, sector)], hash)
+		if (e->sector == sector && e->size == size && e->alg == alg)
+			return e;
+	return NULL;
+}
+
+int drbd_csum_cache_create(struct drbd_device *device, unsigned int max_entries)
+{
+	struct drbd_csum_cache *cache;
+	unsigned int nr_buckets, i;
+
+	if (!max_entries)
+		return 0;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
+
+	nr_buckets = roundup_pow_of_two(max(max_entries / 4, 64U));
+	cache->buckets = vzalloc(nr_buckets * sizeof(*cache->buckets));
+	cache->seq = vzalloc(nr_buckets * sizeof(*cache->seq));
+	if (!cache->buckets || !cache->seq) {
+		vfree(cache->buckets);
+		vfree(cache->seq);
+		kfree(cache);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nr_buckets; i++)
+		INIT_HLIST_HEAD(&cache->buckets[i]);
+	spin_lock_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->bucket_mask = nr_buckets - 1;
+	cache->max_entries = max_entries;
+
+	device->csum_cache = cache;
+	return 0;
+}
+
+void drbd_csum_cache_destroy(struct drbd_device *device)
+{
+	struct drbd_csum_cache *cache = device->csum_cache;
+
+	if (!cache)
+		return;
+
+	device->csum_cache = NULL;
+	csum_cache_flush(cache);
+	vfree(cache->buckets);
+	vfree(cache->seq);
+	kfree(cache);
+}
+
+/**
+ * drbd_csum_cache_seq() - Sample the write sequence number of a range
+ * @device:	DRBD device.
+ * @sector:	Start of the range.
+ *
+ * To be called before the read is submitted that the digest is calculated
+ * from, and to be passed on to drbd_csum_cache_insert().
+ * Caller needs to hold a reference on the local disk.
+ */
+unsigned int drbd_csum_cache_seq(struct drbd_device *device, sector_t sector)
+{
+	struct drbd_csum_cache *cache = device->csum_cache;
+
+	if (!cache)
+		return 0;
+	return atomic_read(&cache->seq[csum_cache_bucket(cache, sector)]);
+}
+
+/**
+ * drbd_csum_cache_invalidate() - Forget digests of a range that gets written
+ * @device:	DRBD device.
+ * @sector:	Start of the written range.
+ * @size:	Size of the written range, in bytes.
+ *
+ * Called from the write completion paths, possibly in irq context.
+ * Caller needs to hold a reference on the local disk.
+ */
+void drbd_csum_cache_invalidate(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct drbd_csum_cache *cache = device->csum_cache;
+	sector_t chunk, last_chunk, end = sector + (size >> 9);
+	unsigned int n;
+
+	if (!cache || !size)
+		return;
+
+	chunk = sector >> CSUM_CACHE_CHUNK_SHIFT;
+	last_chunk = (end - 1) >> CSUM_CACHE_CHUNK_SHIFT;
+	for (n = 0; chunk <= last_chunk && n <= cache->bucket_mask; chunk++, n++) {
+		unsigned int b = chunk & cache->bucket_mask;
+		struct csum_cache_entry *e;
+		struct hlist_node *tmp;
+		unsigned long flags;
+
+		atomic_inc(&cache->seq[b]);
+		/* pairs with smp_mb() in drbd_csum_cache_insert() */
+		smp_mb__after_atomic();
+		if (hlist_empty(&cache->buckets[b]))
+			continue;
+
+		spin_lock_irqsave(&cache->lock, flags);
+		hlist_for_each_entry_safe(e, tmp, &cache->buckets[b], hash) {
+			if (e->sector < end && e->sector + (e->size >> 9) > sector)
+				csum_cache_free_entry(cache, e);
+		}
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+}
+
+/**
+ * drbd_csum_cache_lookup() - Get the cached digest of a range
+ * @device:	DRBD device.
+ * @tfm:	Hash algorithm the digest is wanted for.
+ * @sector:	Start of the range.
+ * @size:	Size of the range, in bytes.
+ * @digest:	Buffer for crypto_ahash_digestsize(@tfm) bytes.
+ *
+ * Returns true and fills @digest if the range was not written since its
+ * digest was cached.
+ */
+bool drbd_csum_cache_lookup(struct drbd_device *device, struct crypto_ahash *tfm,
+			    sector_t sector, unsigned int size, void *digest)
+{
+	struct drbd_csum_cache *cache;
+	struct csum_cache_entry *e = NULL;
+	int alg;
+
+	if (!get_ldev(device))
+		return false;
+	cache = device->csum_cache;
+	if (!cache || !tfm)
+		goto out;
+
+	spin_lock_irq(&cache->lock);
+	alg = csum_cache_alg(cache, tfm, false);
+	if (alg >= 0)
+		e = csum_cache_find(cache, alg, sector, size);
+	if (e && e->digest_size == crypto_ahash_digestsize(tfm)) {
+		memcpy(digest, e->digest, e->digest_size);
+		list_move(&e->lru, &cache->lru);
+		cache->hits++;
+	} else {
+		e = NULL;
+		cache->misses++;
+	}
+	spin_unlock_irq(&cache->lock);
+out:
+	put_ldev(device);
+	return e != NULL;
+}
+
+/**
+ * drbd_csum_cache_insert() - Remember the digest of a range
+ * @device:	DRBD device.
+ * @tfm:	Hash algorithm @digest was calculated with.
+ * @sector:	Start of the range.
+ * @size:	Size of the range, in bytes.
+ * @seq:	Return value of drbd_csum_cache_seq() from before the read.
+ * @digest:	The digest of the data read.
+ */
+void drbd_csum_cache_insert(struct drbd_device *device, struct crypto_ahash *tfm,
+			    sector_t sector, unsigned int size, unsigned int seq,
+			    const void *digest)
+{
+	struct drbd_csum_cache *cache;
+	struct csum_cache_entry *e, *old, *victim = NULL;
+	unsigned int b, digest_size;
+
+	if (!get_ldev(device))
+		return;
+	cache = device->csum_cache;
+	if (!cache || !tfm)
+		goto out;
+
+	digest_size = crypto_ahash_digestsize(tfm);
+	if (digest_size > CSUM_CACHE_MAX_DIGEST ||
+	    sector >> CSUM_CACHE_CHUNK_SHIFT !=
+	    (sector + (size >> 9) - 1) >> CSUM_CACHE_CHUNK_SHIFT)
+		goto out;
+
+	e = kmalloc(sizeof(*e), GFP_NOIO);
+	if (!e)
+		goto out;
+	e->sector = sector;
+	e->size = size;
+	e->digest_size = digest_size;
+	memcpy(e->digest, digest, digest_size);
+
+	b = csum_cache_bucket(cache, sector);
+	spin_lock_irq(&cache->lock);
+	e->alg = csum_cache_alg(cache, tfm, true);
+	old = csum_cache_find(cache, e->alg, sector, size);
+	if (old)
+		csum_cache_free_entry(cache, old);
+	hlist_add_head(&e->hash, &cache->buckets[b]);
+	list_add(&e->lru, &cache->lru);
+	cache->nr_entries++;
+	if (cache->nr_entries > cache->max_entries) {
+		victim = list_last_entry(&cache->lru, struct csum_cache_entry, lru);
+		hlist_del(&victim->hash);
+		list_del(&victim->lru);
+		cache->nr_entries--;
+	}
+
+	/* A write that completed after the read was submitted either sees
+	 * the new entry and removes it, or we see its sequence number here. */
+	smp_mb();
+	if (atomic_read(&cache->seq[b]) != seq) {
+		csum_cache_free_entry(cache, e);
+		cache->dropped++;
+	}
+	spin_unlock_irq(&cache->lock);
+	kfree(victim);
+out:
+	put_ldev(device);
+}
+
+void drbd_csum_cache_seq_show(struct seq_file *m, struct drbd_device *device)
+{
+	struct drbd_csum_cache *cache;
+
+	if (!get_ldev_if_state(device, D_FAILED))
+		return;
+	cache = device->csum_cache;
+	if (cache) {
+		spin_lock_irq(&cache->lock);
+		seq_printf(m, "entries: %u/%u\nhits: %llu\nmisses: %llu\ndropped: %llu\n",
+			   cache->nr_entries, cache->max_entries,
+			   (unsigned long long)cache->hits,
+			   (unsigned long long)cache->misses,
+			   (unsigned long long)cache->dropped);
+		spin_unlock_irq(&cache->lock);
+	}
+	put_ldev(device);
+}
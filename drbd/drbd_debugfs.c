@@ -84,6 +84,7 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 		seq_print_rq_state_bit(m, s & RQ_NET_DONE, &sep, "done");
 		seq_print_rq_state_bit(m, s & RQ_NET_SIS, &sep, "sis");
 		seq_print_rq_state_bit(m, s & RQ_NET_OK, &sep, "ok");
+		seq_print_rq_state_bit(m, s & RQ_NET_COALESCED, &sep, "coalesced");
 		if (sep == ' ')
 			seq_puts(m, " -");
 
@@ -567,6 +568,29 @@ static int resource_state_twopc_show(struct seq_file *m, void *pos)
 	return 0;
 }
 
+static int resource_peer_ack_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct peer_ack_ctl ctl;
+
+	spin_lock_irq(&resource->req_lock);
+	ctl = resource->peer_ack_ctl;
+	spin_unlock_irq(&resource->req_lock);
+
+	seq_puts(m, "content and format of this will change without notice\n");
+	seq_printf(m, "max_rate: %u packets/s\n", drbd_peer_ack_max_rate);
+	seq_printf(m, "max_delay: %u ms\n", drbd_peer_ack_max_delay);
+	seq_printf(m, "peers: %u\n", ctl.peers);
+	seq_printf(m, "write_rate: %llu sectors/s\n", (unsigned long long)ctl.sect_per_sec);
+	seq_printf(m, "peer_ack_rate: %u packets/s\n", ctl.acks_per_sec);
+	seq_printf(m, "window: %u sectors (configured %u)\n",
+		   ctl.window, resource->res_opts.peer_ack_window);
+	seq_printf(m, "delay: %u ms (configured %u)\n",
+		   jiffies_to_msecs(ctl.delay), resource->res_opts.peer_ack_delay);
+
+	return 0;
+}
+
 /* make sure at *open* time that the respective object won't go away. */
 static int drbd_single_open(struct file *file, int (*show)(struct seq_file *, void *),
 		                void *data, struct kref *kref,
@@ -621,6 +645,7 @@ static const struct file_operations resource_ ## name ## _fops = {	\
 
 drbd_debugfs_resource_attr(in_flight_summary)
 drbd_debugfs_resource_attr(state_twopc)
+drbd_debugfs_resource_attr(peer_ack)
 
 #define drbd_dcf(top, obj, attr, perm) do {			\
 	dentry = debugfs_create_file(#attr, perm,		\
@@ -666,6 +691,7 @@ void drbd_debugfs_resource_add(struct drbd_resource *resource)
 	/* debugfs create file */
 	res_dcf(in_flight_summary);
 	res_dcf(state_twopc);
+	res_dcf(peer_ack);
 
 	return;
 
@@ -690,6 +716,7 @@ void drbd_debugfs_resource_cleanup(struct drbd_resource *resource)
 	 * and call debugfs_remove on all of them separately.
 	 */
 	/* it is ok to call debugfs_remove(NULL) */
+	drbd_debugfs_remove(&resource->debugfs_res_peer_ack);
 	drbd_debugfs_remove(&resource->debugfs_res_state_twopc);
 	drbd_debugfs_remove(&resource->debugfs_res_in_flight_summary);
 	drbd_debugfs_remove(&resource->debugfs_res_connections);
@@ -845,6 +872,8 @@ static int connection_debug_show(struct seq_file *m, void *ignored)
 	seq_printf(m, " send.current_dagtag_sec: %llu (%lld)\n", ull2, (long long)(ull2 - ull1));
 	ull2 = connection->last_dagtag_sector;
 	seq_printf(m, "      last_dagtag_sector: %llu\n", ull2);
+	seq_printf(m, "  send.coalesced_packets: %lu\n", connection->send.coalesced_packets);
+	seq_printf(m, "   send.coalesced_writes: %lu\n", connection->send.coalesced_writes);
 
 	return 0;
 }
@@ -1150,6 +1179,116 @@ static ssize_t device_req_timing_write(struct file *file, const char __user *ubu
 	return cnt;
 }
 
+static void seq_print_lat_hist(struct seq_file *m, const char *name, struct drbd_lat_hist *h)
+{
+	u64 n = 0;
+	int i;
+
+	for (i = 0; i < DRBD_LAT_HIST_BUCKETS; i++)
+		n += h->count[i];
+
+	seq_printf(m, "%-16s count: %llu avg: %llu max: %llu\n", name,
+		   (unsigned long long)n,
+		   (unsigned long long)(n ? div64_u64(h->sum_us, n) : 0),
+		   (unsigned long long)h->max_us);
+	if (!n)
+		return;
+	seq_puts(m, " ");
+	for (i = 0; i < DRBD_LAT_HIST_BUCKETS; i++) {
+		if (h->count[i])
+			seq_printf(m, " %llu:%llu",
+				   (unsigned long long)drbd_lat_hist_bucket_start(i),
+				   (unsigned long long)h->count[i]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int device_req_latency_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_peer_device *peer_device;
+
+	seq_puts(m, "write latency in microseconds; write an 'r' to reset all\n"
+		    "buckets are listed as <lower bound>:<count>, empty ones are omitted\n\n");
+
+	seq_print_lat_hist(m, "al_wait", &device->lat_al);
+	seq_print_lat_hist(m, "local_disk", &device->lat_local);
+	seq_print_lat_hist(m, "total", &device->lat_total);
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		struct drbd_connection *connection = peer_device->connection;
+
+		seq_printf(m, "\npeer %s:\n", rcu_dereference(connection->transport.net_conf)->name);
+		seq_print_lat_hist(m, "send_queue", &peer_device->lat_send_queue);
+		seq_print_lat_hist(m, "peer_ack", &peer_device->lat_peer_ack);
+		seq_print_lat_hist(m, "barrier_ack", &peer_device->lat_barrier_ack);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static ssize_t device_req_latency_write(struct file *file, const char __user *ubuf,
+					size_t cnt, loff_t *ppos)
+{
+	struct drbd_device *device = file_inode(file)->i_private;
+	char buffer;
+
+	if (copy_from_user(&buffer, ubuf, 1))
+		return -EFAULT;
+
+	if (buffer == 'r' || buffer == 'R') {
+		struct drbd_peer_device *peer_device;
+		unsigned long flags;
+
+		spin_lock_irqsave(&device->timing_lock, flags);
+		memset(&device->lat_al, 0, sizeof(device->lat_al));
+		memset(&device->lat_local, 0, sizeof(device->lat_local));
+		memset(&device->lat_total, 0, sizeof(device->lat_total));
+		for_each_peer_device(peer_device, device) {
+			memset(&peer_device->lat_send_queue, 0, sizeof(peer_device->lat_send_queue));
+			memset(&peer_device->lat_peer_ack, 0, sizeof(peer_device->lat_peer_ack));
+			memset(&peer_device->lat_barrier_ack, 0, sizeof(peer_device->lat_barrier_ack));
+		}
+		spin_unlock_irqrestore(&device->timing_lock, flags);
+	}
+
+	*ppos += cnt;
+	return cnt;
+}
+
+static int device_csum_cache_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	drbd_csum_cache_seq_show(m, device);
+	return 0;
+}
+
+static int device_flush_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_flush_state *fs = &device->flush;
+	u64 requested, issued, skipped;
+	bool in_flight;
+
+	spin_lock_irq(&fs->lock);
+	requested = fs->requested;
+	issued = fs->issued;
+	skipped = fs->skipped;
+	in_flight = fs->in_flight;
+	spin_unlock_irq(&fs->lock);
+
+	/* requested: per epoch, issued + skipped + merged == requested */
+	seq_printf(m, "requested: %llu\nissued: %llu\nskipped: %llu\nmerged: %llu\nin flight: %s\n",
+		   (unsigned long long)requested, (unsigned long long)issued,
+		   (unsigned long long)skipped,
+		   (unsigned long long)(requested - issued - skipped),
+		   in_flight ? "yes" : "no");
+	return 0;
+}
+
 static int device_attr_release(struct inode *inode, struct file *file)
 {
 	struct drbd_device *device = inode->i_private;
@@ -1180,7 +1319,10 @@ drbd_debugfs_device_attr(act_log_histogram)
 drbd_debugfs_device_attr(data_gen_id)
 drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
+drbd_debugfs_device_attr(csum_cache)
+drbd_debugfs_device_attr(flush)
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
+__drbd_debugfs_device_attr(req_latency, device_req_latency_write)
 
 void drbd_debugfs_device_add(struct drbd_device *device)
 {
@@ -1219,7 +1361,10 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(data_gen_id);
 	vol_dcf(io_frozen);
 	vol_dcf(ed_gen_id);
+	vol_dcf(csum_cache);
+	vol_dcf(flush);
 	drbd_dcf(device->debugfs_vol, device, req_timing, S_IRUSR | S_IWUSR);
+	drbd_dcf(device->debugfs_vol, device, req_latency, S_IRUSR | S_IWUSR);
 
 	/* Caller holds conf_update */
 	for_each_peer_device(peer_device, device) {
@@ -1244,6 +1389,9 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_io_frozen);
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
+	drbd_debugfs_remove(&device->debugfs_vol_req_latency);
+	drbd_debugfs_remove(&device->debugfs_vol_csum_cache);
+	drbd_debugfs_remove(&device->debugfs_vol_flush);
 	drbd_debugfs_remove(&device->debugfs_vol);
 }
 
@@ -1578,6 +1726,40 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int peer_device_resync_controller_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+	struct rs_model model;
+
+	spin_lock(&peer_device->rs_model_lock);
+	model = peer_device->rs_model;
+	spin_unlock(&peer_device->rs_model_lock);
+
+	seq_puts(m, "content and format of this will change without notice\n");
+	seq_printf(m, "controller: %s\n",
+		   drbd_resync_controller == RS_CONTROLLER_MODEL ? "model" : "plan-ahead");
+	seq_printf(m, "c_sync_rate: %d KiB/s\n", peer_device->c_sync_rate);
+	seq_printf(m, "rs_in_flight: %d sectors\n", peer_device->rs_in_flight);
+	seq_printf(m, "phase: %s\n", model.startup ? "startup" : "steady");
+	seq_printf(m, "btl_bw: %u sectors/s\n", model.btl_bw);
+	seq_printf(m, "min_rtt: %u us\n", model.min_rtt_us);
+	seq_printf(m, "srtt: %u us\n", model.srtt_us);
+	seq_printf(m, "local_disk: %u us\n", model.disk_us);
+	seq_printf(m, "app_write_latency: %u us (target %u)\n",
+		   peer_device->device->write_lat_us, drbd_resync_latency_target);
+	seq_printf(m, "app_disk_latency: %u us (baseline %u, throttle at %u%s)\n",
+		   peer_device->device->disk_lat_us, peer_device->device->disk_lat_base_us,
+		   drbd_resync_throttle_latency,
+		   peer_device->device->rs_lat_throttled ? ", throttling" : "");
+	seq_printf(m, "scale: %u%%\n", model.scale);
+	seq_printf(m, "target: %u sectors\n", model.target);
+	seq_printf(m, "pace: %u sectors per %u ms\n", model.pace, jiffies_to_msecs(SLEEP_TIME));
+	seq_printf(m, "issued: %llu received: %llu sectors\n",
+		   (unsigned long long)model.issued, (unsigned long long)model.received);
+
+	return 0;
+}
+
 #define drbd_debugfs_peer_device_attr(name)					\
 static int peer_device_ ## name ## _open(struct inode *inode, struct file *file)\
 {										\
@@ -1603,6 +1785,7 @@ static const struct file_operations peer_device_ ## name ## _fops = {		\
 
 drbd_debugfs_peer_device_attr(resync_extents)
 drbd_debugfs_peer_device_attr(proc_drbd)
+drbd_debugfs_peer_device_attr(resync_controller)
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1622,6 +1805,7 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
 	peer_dev_dcf(proc_drbd);
+	peer_dev_dcf(resync_controller);
 	return;
 
 fail:
@@ -1631,6 +1815,7 @@ fail:
 
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_controller);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_proc_drbd);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
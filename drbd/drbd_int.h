@@ -44,6 +44,7 @@
 #include <linux/idr.h>
 #include <linux/lru_cache.h>
 #include <linux/prefetch.h>
+#include <linux/hash.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd.h>
 #include <linux/drbd_config.h>
@@ -86,6 +87,25 @@
 
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
+extern unsigned int drbd_peer_ack_max_rate;
+extern unsigned int drbd_peer_ack_max_delay;
+extern unsigned int drbd_coalesce_writes_kb;
+extern unsigned int drbd_coalesce_writes_delay;
+extern unsigned int drbd_resync_controller;
+extern unsigned int drbd_resync_latency_target;
+extern bool drbd_resync_refill;
+extern bool drbd_multi_source_resync;
+extern bool drbd_verify_tree;
+extern bool drbd_digest_offload;
+extern bool drbd_thin_resync_query;
+extern bool drbd_resync_by_heat;
+extern unsigned int drbd_resync_throttle_latency;
+extern bool drbd_fused_integrity;
+extern bool drbd_peer_write_submitter;
+extern unsigned int drbd_large_page_order;
+extern unsigned int drbd_ack_batch_size;
+extern unsigned int drbd_ack_batch_delay;
+extern unsigned int drbd_csum_cache_entries;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -109,10 +129,137 @@ extern char drbd_usermode_helper[];
 
 #define ID_IN_SYNC      (4711ULL)
 #define ID_OUT_OF_SYNC  (4712ULL)
+#define ID_OV_DESCEND   (4713ULL)
 #define ID_SYNCER (-1ULL)
 
 #define UUID_NEW_BM_OFFSET ((u64)0x0001000000000000ULL)
 
+/* Recent application IO per activity log extent, for resync_by_heat.
+ * Direct mapped, a colliding extent wears down the heat of the current
+ * one before it takes over the slot.  Updated without locking,
+ * it is a hint only.  See drbd_heat_account(). */
+#define DRBD_HEAT_BITS	8
+struct drbd_heat_slot {
+	unsigned int enr;
+	unsigned int heat;
+};
+
+/* Out of order resync of hot extents per resync run */
+#define RS_HOT_MAX	32
+
+/* Copy of the bitmap words around the position of make_resync_request(),
+ * see rs_bm_find_next().  Valid while gen matches device->rs_bm_window_gen. */
+#define RS_BM_WINDOW_BITS	4096
+struct rs_bm_window {
+	unsigned long start;	/* first bit */
+	unsigned long end;	/* one past the last bit */
+	unsigned int gen;
+	unsigned long words[RS_BM_WINDOW_BITS / BITS_PER_LONG];
+};
+
+/* Log-linear latency histogram, values in microseconds.
+ * Below 2^DRBD_LAT_HIST_SUB_BITS each value has its own bucket, above that
+ * each power of two is split into 2^DRBD_LAT_HIST_SUB_BITS linear buckets.
+ * The last bucket also collects everything beyond about two minutes. */
+#define DRBD_LAT_HIST_SUB_BITS	2
+#define DRBD_LAT_HIST_BUCKETS	(26 << DRBD_LAT_HIST_SUB_BITS)
+
+struct drbd_lat_hist {
+	u64 count[DRBD_LAT_HIST_BUCKETS];
+	u64 sum_us;
+	u64 max_us;
+};
+
+static inline unsigned int drbd_lat_hist_bucket(u64 us)
+{
+	unsigned int shift, idx;
+
+	if (us < (1 << DRBD_LAT_HIST_SUB_BITS))
+		return us;
+	shift = fls64(us) - 1 - DRBD_LAT_HIST_SUB_BITS;
+	idx = ((shift + 1) << DRBD_LAT_HIST_SUB_BITS) +
+		((us >> shift) & ((1 << DRBD_LAT_HIST_SUB_BITS) - 1));
+	return min_t(unsigned int, idx, DRBD_LAT_HIST_BUCKETS - 1);
+}
+
+/* smallest value counted in bucket idx */
+static inline u64 drbd_lat_hist_bucket_start(unsigned int idx)
+{
+	unsigned int group = idx >> DRBD_LAT_HIST_SUB_BITS;
+
+	if (!group)
+		return idx;
+	return (u64)((1 << DRBD_LAT_HIST_SUB_BITS) +
+		     (idx & ((1 << DRBD_LAT_HIST_SUB_BITS) - 1))) << (group - 1);
+}
+
+/* WRITE_ZEROES replicated as sector range only: P_ZEROES is laid out
+ * like P_TRIM, DP_ZEROES marks it in dp_flags, DP_DISCARD additionally
+ * allows the peer to unmap.  Only sent if DRBD_FF_WZEROES was agreed on. */
+#ifndef DRBD_FF_WZEROES
+#define DRBD_FF_WZEROES 8
+#endif
+#ifndef P_ZEROES
+#define P_ZEROES 0x36
+#endif
+#ifndef DP_ZEROES
+#define DP_ZEROES 1024
+#endif
+
+/* Hierarchical online verify: P_OV_REQUEST covers up to DRBD_OV_TREE_SIZE,
+ * where the digests differ, the verify source answers P_OV_RESULT with
+ * ID_OV_DESCEND and asks again for DRBD_OV_TREE_FANOUT sub-ranges.
+ * Only done if DRBD_FF_OV_TREE was agreed on.  That bit needs to be
+ * assigned in drbd_protocol.h, which is shared with drbd-utils and the
+ * upstream module; as long as it is not, the feature is not advertised. */
+#ifndef DRBD_FF_OV_TREE
+#define DRBD_FF_OV_TREE 0
+#endif
+#define DRBD_OV_TREE_SIZE	(1U << 20)
+#define DRBD_OV_TREE_FANOUT	8
+#define OV_DESCEND_MAX		32
+
+struct ov_range {
+	sector_t sector;
+	unsigned int size;	/* still to be asked for */
+	unsigned int child_size;
+};
+
+/* Batched write acks: one P_ACK_BATCH on the control stream carries the
+ * P_WRITE_ACKs or P_RS_WRITE_ACKs (cmd) of up to DRBD_ACK_BATCH_MAX peer
+ * requests of one volume.  seq_num is that of the last ack in the batch.
+ * Only sent if DRBD_FF_ACK_BATCH was agreed on.  The feature bit and the
+ * P_ACK_BATCH packet number come from drbd_protocol.h, which is shared with
+ * drbd-utils and the upstream module.  As long as it does not assign them,
+ * batching is not advertised and P_ACK_BATCH is not understood. */
+#ifndef DRBD_FF_ACK_BATCH
+#define DRBD_FF_ACK_BATCH 0
+#endif
+#define DRBD_ACK_BATCH_MAX	32
+
+struct p_ack_batch_entry {
+	u64 sector;	/* big endian, like in struct p_block_ack */
+	u64 block_id;
+	u32 blksize;
+} __packed;
+
+struct p_ack_batch {
+	u32 seq_num;
+	u16 cmd;
+	u16 count;
+	struct p_ack_batch_entry ack[0];
+} __packed;
+
+/* May a zero-out be done by unmapping, or must the blocks stay allocated? */
+static inline bool drbd_bio_may_unmap(struct bio *bio)
+{
+#ifdef REQ_NOUNMAP
+	if (bio_op(bio) == REQ_OP_WRITE_ZEROES && (bio->bi_opf & REQ_NOUNMAP))
+		return false;
+#endif
+	return true;
+}
+
 struct drbd_device;
 struct drbd_connection;
 
@@ -326,6 +473,10 @@ struct drbd_request {
 
 	/* local disk */
 	ktime_t pre_submit_kt;
+	ktime_t local_done_kt;
+
+	/* master bio completed, application visible latency */
+	ktime_t completed_kt;
 
 	/* per connection */
 	ktime_t pre_send_kt[DRBD_PEERS_MAX];
@@ -408,10 +559,12 @@ struct digest_info {
 	void *digest;
 };
 
+/* New members need to be initialized in drbd_alloc_peer_req(), the object
+ * is not cleared there any more. */
 struct drbd_peer_request {
 	struct drbd_work w;
 	struct drbd_peer_device *peer_device;
-	struct list_head recv_order; /* writes only */
+	struct list_head recv_order; /* writes only; reads: see queue_digest() */
 	/* writes only, blocked on activity log;
 	 * FIXME merge with rcv_order or w.list? */
 	struct list_head wait_for_actlog;
@@ -430,7 +583,7 @@ struct drbd_peer_request {
 				struct digest_info *digest;
 			};
 			u64 dagtag_sector;
-
+			unsigned int csum_cache_seq; /* see drbd_csum_cache_seq() */
 		};
 		struct { /* reused object to queue send OOS to other nodes */
 			u64 sent_oos_nodes; /* Used to notify L_SYNC_TARGETs about new out_of_sync bits */
@@ -459,6 +612,8 @@ enum {
 	/* our lower level cannot handle trim,
 	 * and we want to fall back to zeroout instead */
 	__EE_IS_TRIM_USE_ZEROOUT,
+	/* P_ZEROES without DP_DISCARD, the zeroed blocks must stay allocated */
+	__EE_ZEROOUT_NOUNMAP,
 
 	/* In case a barrier failed,
 	 * we need to resubmit without the barrier flag. */
@@ -500,11 +655,25 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* Digest taken from the csum cache, nothing was read */
+	__EE_CSUM_CACHED,
+
+	/* The local digest was calculated or taken from the cache already.
+	 * Without a digest from the peer, peer_req->digest holds it;
+	 * with one, EE_DIGEST_EQUAL tells the outcome of the comparison. */
+	__EE_DIGEST_DONE,
+	__EE_DIGEST_EQUAL,
+
+	/* P_RS_THIN_REQ for a range the backing device has not allocated,
+	 * nothing was read, see drbd_range_allocated() */
+	__EE_RS_UNALLOCATED,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_IS_BARRIER          (1<<__EE_IS_BARRIER)
 #define EE_IS_TRIM             (1<<__EE_IS_TRIM)
 #define EE_IS_TRIM_USE_ZEROOUT (1<<__EE_IS_TRIM_USE_ZEROOUT)
+#define EE_ZEROOUT_NOUNMAP     (1<<__EE_ZEROOUT_NOUNMAP)
 #define EE_RESUBMITTED         (1<<__EE_RESUBMITTED)
 #define EE_WAS_ERROR           (1<<__EE_WAS_ERROR)
 #define EE_HAS_DIGEST          (1<<__EE_HAS_DIGEST)
@@ -517,6 +686,11 @@ enum {
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_CSUM_CACHED		(1<<__EE_CSUM_CACHED)
+#define EE_DIGEST_DONE		(1<<__EE_DIGEST_DONE)
+#define EE_DIGEST_EQUAL		(1<<__EE_DIGEST_EQUAL)
+#define EE_RS_UNALLOCATED	(1<<__EE_RS_UNALLOCATED)
+#define EE_NOT_READ		(EE_CSUM_CACHED|EE_RS_UNALLOCATED)
 
 /* flag bits per device */
 enum {
@@ -568,6 +742,8 @@ enum {
 	INITIAL_STATE_RECEIVED,
 	RECONCILIATION_RESYNC,
 	UNSTABLE_RESYNC,	/* Sync source went unstable during resync. */
+	RS_CO_SOURCE_LEFT,	/* Peer ended its resync from us early, the other
+				   sources of its multi-source resync are still at it. */
 	SEND_STATE_AFTER_AHEAD,
 	GOT_NEG_ACK,		/* got a neg_ack while primary, wait until peer_disk is lower than
 				   D_UP_TO_DATE before becoming secondary! */
@@ -686,12 +862,25 @@ struct drbd_md {
 	u32 al_size_4k; /* cached product of the above */
 };
 
+/* Ranges of the backing device we zeroed or unmapped ourselves, and did not
+ * write since.  They read back zeroes, see drbd_range_allocated(). */
+#define DRBD_ZEROED_RANGES 32
+struct drbd_zeroed_ranges {
+	spinlock_t lock;
+	unsigned int nr;
+	struct {
+		sector_t sector;
+		sector_t end;
+	} r[DRBD_ZEROED_RANGES];
+};
+
 struct drbd_backing_dev {
 	struct block_device *backing_bdev;
 	struct block_device *md_bdev;
 	struct drbd_md md;
 	struct disk_conf *disk_conf; /* RCU, for updates: resource->conf_update */
 	sector_t known_size; /* last known size of that backing device */
+	struct drbd_zeroed_ranges zeroed;
 };
 
 struct drbd_md_io {
@@ -714,6 +903,41 @@ struct bm_io_work {
 	void (*done)(struct drbd_device *device, struct drbd_peer_device *, int rv);
 };
 
+/* values of the resync_controller module parameter */
+enum drbd_resync_controller {
+	RS_CONTROLLER_PLAN_AHEAD,	/* c_fill_target, c_delay_target */
+	RS_CONTROLLER_MODEL,		/* bandwidth and RTT estimation */
+};
+
+/* State of the model based resync controller, see drbd_rs_model_controller() */
+#define RS_MODEL_MARKS		16	/* request batches we track for RTT samples */
+#define RS_MODEL_BW_WINDOW	10	/* delivery rate samples, in SLEEP_TIME ticks */
+
+struct rs_model {
+	ktime_t last_kt;		/* last invocation of the controller */
+	u64 issued;			/* sectors requested, cumulative */
+	u64 received;			/* sectors answered, cumulative */
+	struct {
+		u64 issued;		/* value of issued after this batch */
+		ktime_t kt;		/* when the batch was requested */
+	} marks[RS_MODEL_MARKS];
+	unsigned int mark_head, mark_tail;
+	unsigned int bw[RS_MODEL_BW_WINDOW];	/* sectors per second */
+	unsigned int bw_idx;
+	unsigned int btl_bw;		/* bottleneck bandwidth estimate, sectors/s */
+	unsigned int min_rtt_us;	/* round trip time estimate */
+	ktime_t min_rtt_kt;		/* when min_rtt_us was taken */
+	unsigned int srtt_us;		/* smoothed round trip time */
+	unsigned int disk_us;		/* smoothed local write time of resync data */
+	unsigned int full_bw;		/* to detect the end of the startup phase */
+	unsigned int full_bw_cnt;
+	unsigned int cycle;		/* bandwidth probing cycle */
+	unsigned int scale;		/* percent, reduced while over the latency target */
+	unsigned int target;		/* sectors we want in flight */
+	unsigned int pace;		/* sectors we may request per SLEEP_TIME */
+	bool startup;
+};
+
 struct fifo_buffer {
 	/* singly linked list to accumulate multiple such struct fifo_buffers,
 	 * to be freed after a single syncronize_rcu(),
@@ -825,6 +1049,7 @@ struct drbd_resource {
 	struct dentry *debugfs_res_connections;
 	struct dentry *debugfs_res_in_flight_summary;
 	struct dentry *debugfs_res_state_twopc;
+	struct dentry *debugfs_res_peer_ack;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -848,6 +1073,17 @@ struct drbd_resource {
 	struct list_head peer_ack_list;  /* requests to send peer acks for */
 	u64 last_peer_acked_dagtag;  /* dagtag of last PEER_ACK'ed request */
 	struct drbd_request *peer_ack_req;  /* last request not yet PEER_ACK'ed */
+	struct peer_ack_ctl {		/* adaptive peer ack coalescing, protected by req_lock */
+		unsigned long period_start_jif;	/* start of the current sampling period */
+		u64 period_start_dagtag;	/* resource->dagtag_sector at that time */
+		unsigned int period_acks;	/* P_PEER_ACK packets queued in this period */
+		unsigned long first_pending_jif; /* when peer_ack_req got its first request */
+		u64 sect_per_sec;		/* observed write rate */
+		unsigned int acks_per_sec;	/* observed P_PEER_ACK packet rate, all peers */
+		unsigned int peers;		/* connections a P_PEER_ACK gets sent to */
+		u32 window;			/* chosen window [unit sectors] */
+		unsigned long delay;		/* chosen delay [unit jiffies] */
+	} peer_ack_ctl;
 
 	struct semaphore state_sem;
 	wait_queue_head_t state_wait;  /* upon each state change. */
@@ -967,6 +1203,18 @@ struct drbd_connection {
 	struct list_head done_ee;   /* need to send P_WRITE_ACK */
 	atomic_t done_ee_cnt;
 	struct work_struct send_acks_work;
+	struct drbd_ack_batch {
+		/* only used by drbd_finish_peer_reqs() and its callbacks */
+		unsigned int max;	/* 0 while not batching */
+		struct drbd_peer_device *peer_device;
+		enum drbd_packet cmd;
+		unsigned int count;
+		struct p_ack_batch_entry ack[DRBD_ACK_BATCH_MAX];
+		/* put when the batch is sent, so that the P_BARRIER_ACK
+		 * follows the acks of its writes */
+		struct drbd_epoch *epoch[DRBD_ACK_BATCH_MAX];
+		bool cleanup[DRBD_ACK_BATCH_MAX];
+	} ack_batch;
 	wait_queue_head_t ee_wait;
 
 	atomic_t pp_in_use;		/* allocated from page pool */
@@ -1045,6 +1293,10 @@ struct drbd_connection {
 
 		/* position in change stream */
 		u64 current_dagtag_sector;
+
+		/* statistics of write coalescing, see coalesce_writes() */
+		unsigned long coalesced_packets;
+		unsigned long coalesced_writes;
 	} send;
 
 	unsigned int peer_node_id;
@@ -1148,7 +1400,24 @@ struct drbd_peer_device {
 	int rs_last_events;  /* counter of read or write "events" (unit sectors)
 			      * on the lower level device when we last looked. */
 	int rs_in_flight; /* resync sectors in flight (to proxy, in proxy and from proxy) */
+	int rs_window; /* sectors the controller wants in flight until its next tick */
+	int rs_tick_left; /* requests of this tick's budget not issued yet */
+	/* resync_by_heat, extents synced ahead of the sweep, see rs_find_next_hot() */
+	bool rs_hot_active;
+	unsigned int rs_hot_enr;
+	unsigned long rs_hot_fo;
+	unsigned int rs_hot_nr;
+	unsigned int rs_hot_served[RS_HOT_MAX];
+	struct rs_bm_window rs_bm_window;
+	struct drbd_work resync_refill_work;
+	spinlock_t rs_model_lock;
+	struct rs_model rs_model;
 	unsigned long ov_left; /* in bits */
+	bool ov_tree; /* hierarchical verify, see make_ov_tree_requests() */
+	int ov_tree_pending; /* P_OV_REQUESTs not yet compared */
+	int ov_tree_credit; /* request budget saved up for the next range, in bits */
+	unsigned int ov_descend_head, ov_descend_tail;
+	struct ov_range ov_descend[OV_DESCEND_MAX];
 
 	u64 current_uuid;
 	u64 bitmap_uuids[DRBD_PEERS_MAX];
@@ -1166,11 +1435,17 @@ struct drbd_peer_device {
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
 	struct dentry *debugfs_peer_dev_proc_drbd;
+	struct dentry *debugfs_peer_dev_resync_controller;
 #endif
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
 	ktime_t net_done_kt;
 
+	/* per phase latency of writes, protected by device->timing_lock */
+	struct drbd_lat_hist lat_send_queue;	/* queued -> start sending */
+	struct drbd_lat_hist lat_peer_ack;	/* start sending -> P_WRITE_ACK/P_RECV_ACK */
+	struct drbd_lat_hist lat_barrier_ack;	/* peer ack -> P_BARRIER_ACK */
+
 	struct {/* sender todo per peer_device */
 		bool was_ahead;
 	} todo;
@@ -1185,6 +1460,27 @@ struct submit_worker {
 	struct list_head peer_writes;
 };
 
+/* Flushes of the backing device at the end of epochs, see
+ * drbd_flush_after_epoch().  Flushes are numbered by generation.  A request
+ * for a flush joins the one in flight if no write completed since it was
+ * submitted, otherwise all such requests share the next one. */
+struct drbd_flush_state {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	atomic_t writes;		/* completed peer writes */
+	unsigned int started;		/* generation of the last flush submitted */
+	unsigned int done;		/* generation of the last flush completed */
+	int in_flight_writes;		/* writes when the one in flight was submitted */
+	int flushed_writes;		/* ... when the last successful one was */
+	bool in_flight;
+	bool have_flushed;		/* flushed_writes is valid */
+	int error;			/* of the last flush completed */
+
+	u64 requested;
+	u64 issued;
+	u64 skipped;			/* no writes since the last flush */
+};
+
 struct drbd_device {
 #ifdef PARANOIA
 	long magic;
@@ -1194,6 +1490,7 @@ struct drbd_device {
 	struct list_head pending_bitmap_io;
 
 	unsigned long flush_jif;
+	struct drbd_flush_state flush;
 #ifdef CONFIG_DEBUG_FS
 	struct dentry *debugfs_minor;
 	struct dentry *debugfs_vol;
@@ -1204,6 +1501,9 @@ struct drbd_device {
 	struct dentry *debugfs_vol_io_frozen;
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_req_timing;
+	struct dentry *debugfs_vol_req_latency;
+	struct dentry *debugfs_vol_csum_cache;
+	struct dentry *debugfs_vol_flush;
 #endif
 
 	unsigned int vnr;	/* volume number within the connection */
@@ -1246,6 +1546,7 @@ struct drbd_device {
 	/* Interval trees of pending local requests */
 	struct rb_root read_requests;
 	struct rb_root write_requests;
+	struct drbd_interval_index write_index;	/* of write_requests */
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1255,6 +1556,9 @@ struct drbd_device {
 	struct drbd_bitmap *bitmap;
 	unsigned long bm_resync_fo; /* bit offset for drbd_bm_find_next */
 	struct mutex bm_resync_fo_mutex;
+	unsigned int rs_bm_window_gen; /* under bm_resync_fo_mutex */
+	u64 rs_co_sources_done; /* node mask, see drbd_resync_finished() */
+	struct drbd_heat_slot heat[1 << DRBD_HEAT_BITS];
 
 	int open_rw_cnt, open_ro_cnt;
 	/* FIXME clean comments, restructure so it is more obvious which
@@ -1265,6 +1569,7 @@ struct drbd_device {
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
+	struct drbd_csum_cache *csum_cache; /* see drbd_csum_cache.c */
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
 	unsigned int al_tr_number;
 	int al_tr_cycle;
@@ -1297,6 +1602,20 @@ struct drbd_device {
 	ktime_t al_mid_kt;
 	ktime_t al_after_sync_page_kt;
 
+	/* per phase latency of writes, see drbd_req_destroy() */
+	struct drbd_lat_hist lat_al;		/* start -> in activity log */
+	struct drbd_lat_hist lat_local;		/* submit -> local completion */
+	struct drbd_lat_hist lat_total;		/* start -> master bio completion */
+	unsigned int write_lat_us;		/* smoothed lat_total */
+	ktime_t write_lat_kt;			/* completion of the last sample */
+
+	/* application reads and writes, submit -> local completion,
+	 * see drbd_disk_lat_sample() */
+	unsigned int disk_lat_us;		/* smoothed */
+	unsigned int disk_lat_base_us;		/* slowly following the minimum */
+	unsigned long disk_lat_jif;		/* last sample */
+	bool rs_lat_throttled;
+
 	struct rcu_head rcu;
 	struct work_struct finalize_work;
 };
@@ -1437,6 +1756,21 @@ extern void drbd_thread_current_set_cpu(struct drbd_thread *thi);
 extern void tl_release(struct drbd_connection *, unsigned int barrier_nr,
 		       unsigned int set_size);
 extern void tl_clear(struct drbd_connection *);
+
+/* Tells for a thin backing device which ranges are allocated, so the sync
+ * source can answer P_RS_THIN_REQ without reading zeroes.
+ * range_allocated() returns 1 if any part of the range is allocated,
+ * 0 if none is, and a negative error code if it does not know @bdev. */
+struct drbd_alloc_provider {
+	const char *name;
+	struct list_head list;
+	int (*range_allocated)(struct block_device *bdev, sector_t sector, unsigned int size);
+};
+extern int drbd_register_alloc_provider(struct drbd_alloc_provider *);
+extern void drbd_unregister_alloc_provider(struct drbd_alloc_provider *);
+extern bool drbd_range_allocated(struct drbd_device *, sector_t, unsigned int);
+extern void drbd_zeroed_add(struct drbd_backing_dev *, sector_t, unsigned int nr_sectors);
+extern void drbd_zeroed_forget(struct drbd_backing_dev *, sector_t, unsigned int nr_sectors);
 extern void drbd_free_sock(struct drbd_connection *connection);
 
 extern int __drbd_send_protocol(struct drbd_connection *connection, enum drbd_packet cmd);
@@ -1453,7 +1787,11 @@ extern void drbd_send_b_ack(struct drbd_connection *connection, u32 barrier_nr,
 extern int drbd_send_out_of_sync(struct drbd_peer_device *, struct drbd_interval *);
 extern int drbd_send_block(struct drbd_peer_device *, enum drbd_packet,
 			   struct drbd_peer_request *);
-extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
+/* Upper bound of application writes sent coalesced in one P_DATA packet */
+#define DRBD_MAX_COALESCED_REQS 16
+
+extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req,
+			    struct drbd_request **more, int n_more);
 extern int drbd_send_drequest(struct drbd_peer_device *, int cmd,
 			      sector_t sector, int size, u64 block_id);
 extern void *drbd_prepare_drequest_csum(struct drbd_peer_request *peer_req, int digest_size);
@@ -1620,6 +1958,7 @@ extern void tl_abort_disk_io(struct drbd_device *device);
 
 /* in one sector of the bitmap, we have this many activity_log extents. */
 #define AL_EXT_PER_BM_SECT  (1 << (BM_EXT_SHIFT - AL_EXTENT_SHIFT))
+#define BM_BITS_PER_AL_EXT  (1UL << (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT))
 
 /* the extent in "PER_EXTENT" below is an activity log extent
  * we need that many (long words/bytes) to store the bitmap
@@ -1695,6 +2034,9 @@ extern void drbd_bm_set_many_bits(struct drbd_peer_device *, unsigned long, unsi
 extern void drbd_bm_clear_many_bits(struct drbd_peer_device *, unsigned long, unsigned long);
 extern void _drbd_bm_clear_many_bits(struct drbd_device *, int, unsigned long, unsigned long);
 extern int drbd_bm_test_bit(struct drbd_peer_device *, unsigned long);
+extern int drbd_bm_run_length(struct drbd_peer_device *, unsigned long, unsigned int);
+extern unsigned long drbd_bm_find_next_window(struct drbd_peer_device *, unsigned long,
+					      unsigned long *, unsigned long);
 extern int  drbd_bm_read(struct drbd_device *, struct drbd_peer_device *) __must_hold(local);
 extern void drbd_bm_reset_al_hints(struct drbd_device *device) __must_hold(local);
 extern void drbd_bm_mark_range_for_writeout(struct drbd_device *, unsigned long, unsigned long);
@@ -1753,6 +2095,27 @@ extern spinlock_t   drbd_pp_lock;
 extern int	    drbd_pp_vacant;
 extern wait_queue_head_t drbd_pp_wait;
 
+/* Each CPU caches up to two batches of pages in front of drbd_pp_pool,
+ * and refills from or drains to it one batch at a time, so most allocations
+ * and frees do not need drbd_pp_lock.  Chains longer than a batch go
+ * to drbd_pp_pool directly.  drbd_pp_vacant does not count the cached
+ * pages; when drbd_pp_pool runs short, all caches are emptied into it. */
+#define DRBD_PP_BATCH 64
+
+/* A page chain may contain compound pages, if asked for with __GFP_COMP.
+ * They are not kept in drbd_pp_pool. */
+#define DRBD_MAX_LARGE_PAGE_ORDER 8
+static inline unsigned int page_chain_room(struct page *page)
+{
+	return PAGE_SIZE << compound_order(page);
+}
+struct drbd_pp_cache {
+	spinlock_t lock;	/* only contended by drbd_pp_cache_drain() */
+	struct page *pool;
+	int vacant;
+};
+extern struct drbd_pp_cache __percpu *drbd_pp_cache;
+
 /* We also need a standard (emergency-reserve backed) page pool
  * for meta data IO (activity log, bitmap).
  * We can keep it global, as long as it is used as "N pages at a time".
@@ -1858,6 +2221,9 @@ extern void drbd_ov_out_of_sync_found(struct drbd_peer_device *, sector_t, int);
 extern void wait_until_done_or_force_detached(struct drbd_device *device,
 		struct drbd_backing_dev *bdev, unsigned int *done);
 extern void drbd_rs_controller_reset(struct drbd_peer_device *);
+extern void drbd_rs_replies_received(struct drbd_peer_device *, unsigned int sectors);
+extern void drbd_rs_rewind(struct drbd_peer_device *, unsigned long bit);
+extern void drbd_rs_model_disk_sample(struct drbd_peer_device *, unsigned long jif);
 extern void drbd_ping_peer(struct drbd_connection *connection);
 extern struct drbd_peer_device *peer_device_by_node_id(struct drbd_device *, int);
 extern void repost_up_to_date_fn(unsigned long data);
@@ -1874,7 +2240,10 @@ static inline void ov_out_of_sync_print(struct drbd_peer_device *peer_device)
 
 
 extern void drbd_csum_bio(struct crypto_ahash *, struct bio *, void *);
+extern bool drbd_bio_all_zero(struct bio *);
 extern void drbd_csum_pages(struct crypto_ahash *, struct page *, void *);
+extern int drbd_digest_init(void);
+extern void drbd_digest_cleanup(void);
 /* worker callbacks */
 extern int w_e_end_data_req(struct drbd_work *, int);
 extern int w_e_end_rsdata_req(struct drbd_work *, int);
@@ -1883,6 +2252,7 @@ extern int w_e_end_ov_reply(struct drbd_work *, int);
 extern int w_e_end_ov_req(struct drbd_work *, int);
 extern int w_ov_finished(struct drbd_work *, int);
 extern int w_resync_timer(struct drbd_work *, int);
+extern int w_resync_refill(struct drbd_work *, int);
 extern int w_send_dblock(struct drbd_work *, int);
 extern int w_send_read_req(struct drbd_work *, int);
 extern int w_e_reissue(struct drbd_work *, int);
@@ -1893,6 +2263,7 @@ extern int w_send_uuids(struct drbd_work *, int);
 extern void resync_timer_fn(unsigned long data);
 extern void start_resync_timer_fn(unsigned long data);
 
+extern void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req);
 extern void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req);
 
 void __update_timing_details(
@@ -1945,7 +2316,7 @@ struct queued_twopc {
 };
 
 extern int drbd_issue_discard_or_zero_out(struct drbd_device *device,
-		sector_t start, unsigned int nr_sectors, bool discard);
+		sector_t start, unsigned int nr_sectors, bool discard, bool nounmap);
 extern int drbd_send_ack(struct drbd_peer_device *, enum drbd_packet,
 			 struct drbd_peer_request *);
 extern int drbd_send_ack_ex(struct drbd_peer_device *, enum drbd_packet,
@@ -1965,6 +2336,7 @@ extern void drbd_cleanup_after_failed_submit_peer_request(struct drbd_peer_reque
 extern int drbd_free_peer_reqs(struct drbd_resource *, struct list_head *, bool is_net_ee);
 extern struct drbd_peer_request *drbd_alloc_peer_req(struct drbd_peer_device *, gfp_t) __must_hold(local);
 extern void __drbd_free_peer_req(struct drbd_peer_request *, int);
+extern void drbd_peer_req_ctor(void *);
 #define drbd_free_peer_req(pr) __drbd_free_peer_req(pr, 0)
 #define drbd_free_net_peer_req(pr) __drbd_free_peer_req(pr, 1)
 extern void drbd_set_recv_tcq(struct drbd_device *device, int tcq_enabled);
@@ -2042,6 +2414,9 @@ extern int drbd_try_rs_begin_io(struct drbd_peer_device *, sector_t, bool);
 extern void drbd_rs_cancel_all(struct drbd_peer_device *);
 extern int drbd_rs_del_all(struct drbd_peer_device *);
 extern void drbd_rs_failed_io(struct drbd_peer_device *, sector_t, int);
+extern bool drbd_rs_co_source_of_round(struct drbd_peer_device *);
+extern void drbd_rs_set_in_sync(struct drbd_peer_device *, sector_t, int);
+extern void drbd_rs_set_failed(struct drbd_peer_device *, sector_t, int);
 extern void drbd_advance_rs_marks(struct drbd_peer_device *, unsigned long);
 extern bool drbd_set_all_out_of_sync(struct drbd_device *, sector_t, int);
 extern bool drbd_set_sync(struct drbd_device *, sector_t, int, unsigned long, unsigned long);
@@ -2058,6 +2433,19 @@ extern void drbd_al_shrink(struct drbd_device *device);
 extern bool drbd_sector_has_priority(struct drbd_peer_device *, sector_t);
 extern int drbd_al_initialize(struct drbd_device *, void *);
 
+/* drbd_csum_cache.c */
+#define CSUM_CACHE_MAX_DIGEST	64
+struct seq_file;
+extern int drbd_csum_cache_create(struct drbd_device *, unsigned int);
+extern void drbd_csum_cache_destroy(struct drbd_device *);
+extern unsigned int drbd_csum_cache_seq(struct drbd_device *, sector_t);
+extern void drbd_csum_cache_invalidate(struct drbd_device *, sector_t, unsigned int);
+extern bool drbd_csum_cache_lookup(struct drbd_device *, struct crypto_ahash *,
+				   sector_t, unsigned int, void *);
+extern void drbd_csum_cache_insert(struct drbd_device *, struct crypto_ahash *,
+				   sector_t, unsigned int, unsigned int, const void *);
+extern void drbd_csum_cache_seq_show(struct seq_file *, struct drbd_device *);
+
 /* drbd_nl.c */
 
 extern struct mutex notification_mutex;
@@ -2482,6 +2870,33 @@ static inline bool is_sync_target_state(struct drbd_peer_device *peer_device,
 	return repl_state == L_SYNC_TARGET || repl_state == L_PAUSED_SYNC_T;
 }
 
+/* With drbd_multi_source_resync, we are resync target of all our
+ * up-to-date peers at the same time. They all have the same data,
+ * so what we got from one of them is in sync with the others as well. */
+static inline bool is_rs_co_source(struct drbd_peer_device *peer_device,
+				   enum which_state which)
+{
+	return drbd_multi_source_resync &&
+		peer_device->disk_state[which] == D_UP_TO_DATE &&
+		is_sync_target_state(peer_device, which);
+}
+
+static inline void drbd_heat_account(struct drbd_device *device, sector_t sector)
+{
+	unsigned int enr = sector >> (AL_EXTENT_SHIFT - 9);
+	struct drbd_heat_slot *slot = &device->heat[hash_32(enr, DRBD_HEAT_BITS)];
+	unsigned int heat = READ_ONCE(slot->heat);
+
+	if (READ_ONCE(slot->enr) == enr) {
+		WRITE_ONCE(slot->heat, heat + 1);
+	} else if (heat <= 1) {
+		WRITE_ONCE(slot->enr, enr);
+		WRITE_ONCE(slot->heat, 1);
+	} else {
+		WRITE_ONCE(slot->heat, heat - 1);
+	}
+}
+
 static inline bool is_sync_source_state(struct drbd_peer_device *peer_device,
 					enum which_state which)
 {
@@ -2716,6 +3131,14 @@ static inline bool verify_can_do_stop_sector(struct drbd_peer_device *peer_devic
 		peer_device->connection->agreed_pro_version != 100;
 }
 
+/* account for a verified range in ov_left */
+static inline void drbd_ov_done(struct drbd_peer_device *peer_device, unsigned int size)
+{
+	unsigned long bits = DIV_ROUND_UP(size, BM_BLOCK_SIZE);
+
+	peer_device->ov_left -= min(bits, peer_device->ov_left);
+}
+
 static inline u64 drbd_bitmap_uuid(struct drbd_peer_device *peer_device)
 {
 	struct drbd_device *device = peer_device->device;
@@ -1,3 +1,4 @@
+#include <linux/slab.h>
 #include "drbd_interval.h"
 #include "drbd_wrappers.h"
 
@@ -142,6 +143,10 @@ drbd_find_overlap(struct rb_root *root, sector_t sector, unsigned int size)
 
 	BUG_ON(!IS_ALIGNED(size, 512));
 
+	/* Nothing ends behind sector, e.g. sequential writes */
+	if (node && sector >= interval_end(node))
+		return NULL;
+
 	while (node) {
 		struct drbd_interval *here =
 			rb_entry(node, struct drbd_interval, rb);
@@ -180,3 +185,95 @@ drbd_next_overlap(struct drbd_interval *i, sector_t sector, unsigned int size)
 			return i;
 	}
 }
+
+int drbd_interval_index_init(struct drbd_interval_index *index)
+{
+	index->count = kcalloc(DRBD_INTERVAL_BUCKETS, sizeof(*index->count), GFP_KERNEL);
+	return index->count ? 0 : -ENOMEM;
+}
+
+void drbd_interval_index_free(struct drbd_interval_index *index)
+{
+	kfree(index->count);
+	index->count = NULL;
+}
+
+/*
+ * An empty range still counts for the chunk of its sector: drbd_find_overlap()
+ * reports empty intervals that lie within the range searched for, and
+ * intervals that contain the sector of an empty range searched for.
+ */
+static void index_add(struct drbd_interval_index *index, sector_t sector,
+		      unsigned int size, int delta)
+{
+	sector_t chunk = sector >> DRBD_INTERVAL_CHUNK_SHIFT;
+	sector_t last_chunk = (sector + max(size >> 9, 1U) - 1) >> DRBD_INTERVAL_CHUNK_SHIFT;
+	unsigned int n;
+
+	for (n = 0; chunk <= last_chunk && n < DRBD_INTERVAL_BUCKETS; chunk++, n++)
+		index->count[chunk & (DRBD_INTERVAL_BUCKETS - 1)] += delta;
+}
+
+/*
+ * Never misses an overlap: an interval in the tree is counted in the buckets
+ * of all chunks it touches (in every bucket, if it spans that many chunks),
+ * and the query looks at the buckets of all chunks it touches.  Overlapping
+ * ranges share a chunk.  Collisions in a bucket only cause a tree walk that
+ * finds nothing.
+ */
+static bool index_may_overlap(struct drbd_interval_index *index, sector_t sector,
+			      unsigned int size)
+{
+	sector_t chunk = sector >> DRBD_INTERVAL_CHUNK_SHIFT;
+	sector_t last_chunk = (sector + max(size >> 9, 1U) - 1) >> DRBD_INTERVAL_CHUNK_SHIFT;
+	unsigned int n;
+
+	for (n = 0; chunk <= last_chunk && n < DRBD_INTERVAL_BUCKETS; chunk++, n++) {
+		if (index->count[chunk & (DRBD_INTERVAL_BUCKETS - 1)])
+			return true;
+	}
+	return false;
+}
+
+/**
+ * drbd_insert_indexed_interval  -  insert a new interval into a tree and its index
+ */
+bool
+drbd_insert_indexed_interval(struct rb_root *root, struct drbd_interval_index *index,
+			     struct drbd_interval *this)
+{
+	if (!drbd_insert_interval(root, this))
+		return false;
+	if (index && index->count)
+		index_add(index, this->sector, this->size, 1);
+	return true;
+}
+
+/**
+ * drbd_remove_indexed_interval  -  remove an interval from a tree and its index
+ */
+void
+drbd_remove_indexed_interval(struct rb_root *root, struct drbd_interval_index *index,
+			     struct drbd_interval *this)
+{
+	if (drbd_interval_empty(this))
+		return;
+	if (index && index->count)
+		index_add(index, this->sector, this->size, -1);
+	drbd_remove_interval(root, this);
+}
+
+/**
+ * drbd_find_indexed_overlap  -  drbd_find_overlap(), but ask the index first
+ *
+ * Most writes overlap with nothing; for those, the index answers with a look
+ * at one or a few counters instead of a walk down the tree.
+ */
+struct drbd_interval *
+drbd_find_indexed_overlap(struct rb_root *root, struct drbd_interval_index *index,
+			  sector_t sector, unsigned int size)
+{
+	if (index && index->count && !index_may_overlap(index, sector, size))
+		return NULL;
+	return drbd_find_overlap(root, sector, size);
+}
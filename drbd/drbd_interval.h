@@ -67,4 +67,32 @@ extern struct drbd_interval *drbd_next_overlap(struct drbd_interval *, sector_t,
 	     i;							\
 	     i = drbd_next_overlap(i, sector, size))
 
+/*
+ * Number of intervals in a tree per chunk of 1 << DRBD_INTERVAL_CHUNK_SHIFT
+ * sectors, hashed into DRBD_INTERVAL_BUCKETS counters.  If the counters of
+ * all chunks of a range are zero, nothing in the tree overlaps with the
+ * range, and the tree walk is skipped.  Without counters (allocation failed,
+ * or no index given), the tree is always walked.
+ */
+#define DRBD_INTERVAL_CHUNK_SHIFT	7	/* 64 KiB */
+#define DRBD_INTERVAL_BUCKETS		4096
+
+struct drbd_interval_index {
+	unsigned int *count;
+};
+
+extern int drbd_interval_index_init(struct drbd_interval_index *);
+extern void drbd_interval_index_free(struct drbd_interval_index *);
+extern bool drbd_insert_indexed_interval(struct rb_root *, struct drbd_interval_index *,
+					 struct drbd_interval *);
+extern void drbd_remove_indexed_interval(struct rb_root *, struct drbd_interval_index *,
+					 struct drbd_interval *);
+extern struct drbd_interval *drbd_find_indexed_overlap(struct rb_root *,
+					struct drbd_interval_index *, sector_t, unsigned int);
+
+#define drbd_for_each_indexed_overlap(i, root, index, sector, size)	\
+	for (i = drbd_find_indexed_overlap(root, index, sector, size);	\
+	     i;								\
+	     i = drbd_next_overlap(i, sector, size))
+
 #endif  /* __DRBD_INTERVAL_H */
@@ -62,6 +62,9 @@
 #include "drbd_debugfs.h"
 #include "drbd_meta_data.h"
 
+#define CREATE_TRACE_POINTS
+#include "drbd_trace.h"
+
 #ifdef COMPAT_HAVE_LINUX_BYTEORDER_SWABB_H
 #include <linux/byteorder/swabb.h>
 #else
@@ -110,9 +113,12 @@ module_param_named(fault_devs, drbd_fault_devs, int, 0644);
 /* module parameters we can keep static */
 static bool drbd_disable_sendpage;
 static bool drbd_allow_oos; /* allow_open_on_secondary */
+static unsigned int drbd_detect_zero_writes_kb;
 MODULE_PARM_DESC(allow_oos, "DONT USE!");
+MODULE_PARM_DESC(detect_zero_writes_kb, "Replicate all-zero writes of at least this many KiB as P_ZEROES to peers that support it (0 = off)");
 module_param_named(disable_sendpage, drbd_disable_sendpage, bool, 0644);
 module_param_named(allow_oos, drbd_allow_oos, bool, 0);
+module_param_named(detect_zero_writes_kb, drbd_detect_zero_writes_kb, uint, 0644);
 
 /* module parameters shared with defaults */
 unsigned int drbd_minor_count = DRBD_MINOR_COUNT_DEF;
@@ -122,6 +128,99 @@ char drbd_usermode_helper[80] = "/sbin/drbdadm";
 module_param_named(minor_count, drbd_minor_count, uint, 0444);
 module_param_string(usermode_helper, drbd_usermode_helper, sizeof(drbd_usermode_helper), 0644);
 
+/* Adaptive peer ack coalescing, see peer_ack_adapt() in drbd_req.c.
+ * A max_rate of 0 falls back to the static peer-ack-window/peer-ack-delay.
+ * The configured peer-ack-delay stays the upper bound of the delay. */
+unsigned int drbd_peer_ack_max_rate = 4000;
+unsigned int drbd_peer_ack_max_delay = 100;
+MODULE_PARM_DESC(peer_ack_max_rate, "Target upper bound of P_PEER_ACK packets per second and resource, summed over all peers (0 = static window)");
+MODULE_PARM_DESC(peer_ack_max_delay, "Upper bound in ms a completed write waits before it gets PEER_ACK'ed; the peer-ack-delay of the resource is never exceeded either (0 = peer-ack-delay only)");
+module_param_named(peer_ack_max_rate, drbd_peer_ack_max_rate, uint, 0644);
+module_param_named(peer_ack_max_delay, drbd_peer_ack_max_delay, uint, 0644);
+
+/* Coalescing of adjacent writes into one P_DATA packet, see coalesce_writes()
+ * in drbd_sender.c.  A size of 0 disables it. */
+unsigned int drbd_coalesce_writes_kb;
+unsigned int drbd_coalesce_writes_delay;
+MODULE_PARM_DESC(coalesce_writes_kb, "Max size in KiB of adjacent writes sent as one P_DATA packet (0 = off)");
+MODULE_PARM_DESC(coalesce_writes_delay, "Max time in us the sender waits for adjacent writes to coalesce with");
+module_param_named(coalesce_writes_kb, drbd_coalesce_writes_kb, uint, 0644);
+module_param_named(coalesce_writes_delay, drbd_coalesce_writes_delay, uint, 0644);
+
+/* Resync controller used with c-plan-ahead > 0, see drbd_rs_number_requests() */
+unsigned int drbd_resync_controller = RS_CONTROLLER_PLAN_AHEAD;
+unsigned int drbd_resync_latency_target;
+MODULE_PARM_DESC(resync_controller, "0: plan-ahead fill controller, 1: model based (bandwidth and RTT estimation)");
+MODULE_PARM_DESC(resync_latency_target, "Application write latency in us the model based resync controller backs off at (0 = none)");
+module_param_named(resync_controller, drbd_resync_controller, uint, 0644);
+module_param_named(resync_latency_target, drbd_resync_latency_target, uint, 0644);
+
+/* Issue resync requests as replies come in, not only every SLEEP_TIME */
+bool drbd_resync_refill;
+MODULE_PARM_DESC(resync_refill, "Send what is left of the resync budget of a 100ms tick as replies come in, instead of on the next tick");
+module_param_named(resync_refill, drbd_resync_refill, bool, 0644);
+
+/* Resync from all up-to-date peers at once, instead of one after the other */
+bool drbd_multi_source_resync;
+MODULE_PARM_DESC(multi_source_resync, "As resync target, pull from all up-to-date peers in parallel");
+module_param_named(multi_source_resync, drbd_multi_source_resync, bool, 0644);
+
+/* Online verify compares digests of large ranges first */
+bool drbd_verify_tree;
+MODULE_PARM_DESC(verify_tree, "Online verify descends from 1MiB range digests into differing sub-ranges only");
+module_param_named(verify_tree, drbd_verify_tree, bool, 0644);
+
+/* Remember digests of unchanged ranges for checksum based resync and verify */
+unsigned int drbd_csum_cache_entries;
+MODULE_PARM_DESC(csum_cache_entries, "Number of digests cached per volume, taken at attach time; 0 disables the cache");
+module_param_named(csum_cache_entries, drbd_csum_cache_entries, uint, 0644);
+
+/* Calculate resync and verify digests on the CPU that completed the read */
+bool drbd_digest_offload;
+MODULE_PARM_DESC(digest_offload, "Calculate csums-alg and verify-alg digests in per CPU workers instead of the sender thread");
+module_param_named(digest_offload, drbd_digest_offload, bool, 0644);
+
+/* Ask allocation map providers before reading for P_RS_THIN_REQ */
+bool drbd_thin_resync_query;
+MODULE_PARM_DESC(thin_resync_query, "As sync source, answer thin resync requests for unallocated ranges without reading them. "
+		 "Built in are only ranges DRBD itself zeroed or discarded since attach; "
+		 "for the initial sync of a fresh thin volume, an allocation map provider for the backing device is needed");
+module_param_named(thin_resync_query, drbd_thin_resync_query, bool, 0644);
+
+/* Resync the extents the application uses most first */
+bool drbd_resync_by_heat;
+MODULE_PARM_DESC(resync_by_heat, "As sync target, resync extents with recent application IO ahead of the linear sweep");
+module_param_named(resync_by_heat, drbd_resync_by_heat, bool, 0644);
+
+/* Throttle resync by backing device latency instead of by event counts */
+unsigned int drbd_resync_throttle_latency;
+MODULE_PARM_DESC(resync_throttle_latency, "Backing device latency in us of application IO above which resync steps aside (0 = use c-min-rate heuristic)");
+module_param_named(resync_throttle_latency, drbd_resync_throttle_latency, uint, 0644);
+
+/* Hash data-integrity-alg digests of received data page by page */
+bool drbd_fused_integrity;
+MODULE_PARM_DESC(fused_integrity, "Verify data-integrity-alg digests while receiving each page instead of after the whole block");
+module_param_named(fused_integrity, drbd_fused_integrity, bool, 0644);
+
+/* Let the per volume submitter do activity log and submit of peer writes */
+bool drbd_peer_write_submitter;
+MODULE_PARM_DESC(peer_write_submitter, "Hand received writes to the submitter of their volume instead of submitting them from the receiver thread");
+module_param_named(peer_write_submitter, drbd_peer_write_submitter, bool, 0644);
+
+/* Receive large writes into compound pages */
+unsigned int drbd_large_page_order;
+MODULE_PARM_DESC(large_page_order, "Order of the compound pages used for received data, up to 8 (0 = single pages only)");
+module_param_named(large_page_order, drbd_large_page_order, uint, 0644);
+
+/* Write acks of several peer requests in one P_ACK_BATCH, see
+ * drbd_finish_peer_reqs() in drbd_receiver.c.  A size of 0 disables it. */
+unsigned int drbd_ack_batch_size;
+unsigned int drbd_ack_batch_delay;
+MODULE_PARM_DESC(ack_batch_size, "Max number of write acks sent as one P_ACK_BATCH packet, up to 32 (0 = off)");
+MODULE_PARM_DESC(ack_batch_delay, "Time in us the ack sender waits for more completed writes before sending acks");
+module_param_named(ack_batch_size, drbd_ack_batch_size, uint, 0644);
+module_param_named(ack_batch_delay, drbd_ack_batch_delay, uint, 0644);
+
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
  */
@@ -148,6 +247,7 @@ struct page *drbd_pp_pool;
 spinlock_t   drbd_pp_lock;
 int          drbd_pp_vacant;
 wait_queue_head_t drbd_pp_wait;
+struct drbd_pp_cache __percpu *drbd_pp_cache;
 
 static const struct block_device_operations drbd_ops = {
 	.owner =   THIS_MODULE,
@@ -2219,16 +2319,28 @@ static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio
 			(bio->bi_opf & DRBD_REQ_PREFLUSH ? DP_FLUSH : 0) |
 			(bio_op(bio) == REQ_OP_WRITE_SAME ? DP_WSAME : 0) |
 			(bio_op(bio) == REQ_OP_DISCARD ? DP_DISCARD : 0) |
-			(bio_op(bio) == REQ_OP_WRITE_ZEROES ? DP_DISCARD : 0);
+			(bio_op(bio) == REQ_OP_WRITE_ZEROES ?
+			  ((connection->agreed_features & DRBD_FF_WZEROES) ?
+			   (DP_ZEROES | (drbd_bio_may_unmap(bio) ? DP_DISCARD : 0)) :
+			   DP_DISCARD) : 0);
 
 	/* else: we used to communicate one bit only in older DRBD */
 	return bio->bi_opf & (DRBD_REQ_SYNC | DRBD_REQ_UNPLUG) ? DP_RW_SYNC : 0;
 }
 
 /* Used to send write or TRIM aka REQ_DISCARD requests
- * R_PRIMARY -> Peer	(P_DATA, P_TRIM)
+ * R_PRIMARY -> Peer	(P_DATA, P_TRIM, P_ZEROES)
+ *
+ * WRITE_ZEROES, and plain writes found to contain only zeroes, are sent as
+ * P_ZEROES without payload, if the peer supports that.
+ *
+ * @more are n_more plain writes directly following req, both on disk and in
+ * the change stream, which are sent as part of the same P_DATA packet.
+ * The peer sees one larger write, and acknowledges it with the block_id of req;
+ * see coalesce_writes() and got_BlockAck().
  */
-int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
+int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req,
+		     struct drbd_request **more, int n_more)
 {
 	struct drbd_device *device = peer_device->device;
 	struct p_trim *trim = NULL;
@@ -2240,8 +2352,24 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	int err;
 	const unsigned s = drbd_req_state_by_peer_device(req, peer_device);
 	const int op = bio_op(req->master_bio);
+	const bool wzeroes = peer_device->connection->agreed_features & DRBD_FF_WZEROES;
+	enum drbd_packet cmd = P_TRIM;
+	unsigned int size = req->i.size;
+	int i;
+
+	for (i = 0; i < n_more; i++)
+		size += more[i]->i.size;
 
-	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES) {
+	if (op == REQ_OP_WRITE_ZEROES && wzeroes)
+		cmd = P_ZEROES;
+	/* The peer drains its write pipeline before a zero-out, see
+	 * drbd_submit_peer_request(); only worth it for large writes. */
+	else if (op == REQ_OP_WRITE && wzeroes && !n_more && drbd_detect_zero_writes_kb &&
+		 size >= drbd_detect_zero_writes_kb << 10 &&
+		 !peer_device->connection->integrity_tfm && drbd_bio_all_zero(req->master_bio))
+		cmd = P_ZEROES;
+
+	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES || cmd == P_ZEROES) {
 		trim = drbd_prepare_command(peer_device, sizeof(*trim), DATA_STREAM);
 		if (!trim)
 			return -EIO;
@@ -2270,6 +2398,8 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	p->block_id = (unsigned long)req;
 	p->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
 	dp_flags = bio_flags_to_wire(peer_device->connection, req->master_bio);
+	if (cmd == P_ZEROES)
+		dp_flags |= DP_ZEROES;
 	if (peer_device->repl_state[NOW] >= L_SYNC_SOURCE && peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T)
 		dp_flags |= DP_MAY_SET_IN_SYNC;
 	if (peer_device->connection->agreed_pro_version >= 100) {
@@ -2281,7 +2411,7 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	p->dp_flags = cpu_to_be32(dp_flags);
 
 	if (trim) {
-		err = __send_command(peer_device->connection, device->vnr, P_TRIM, DATA_STREAM);
+		err = __send_command(peer_device->connection, device->vnr, cmd, DATA_STREAM);
 		goto out;
 	}
 
@@ -2293,7 +2423,7 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 					bio_iovec(req->master_bio) BVD bv_len);
 		err = __send_command(peer_device->connection, device->vnr, P_WSAME, DATA_STREAM);
 	} else {
-		additional_size_command(peer_device->connection, DATA_STREAM, req->i.size);
+		additional_size_command(peer_device->connection, DATA_STREAM, size);
 		err = __send_command(peer_device->connection, device->vnr, P_DATA, DATA_STREAM);
 	}
 	if (!err) {
@@ -2313,6 +2443,14 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		else
 			err = _drbd_send_zc_bio(peer_device, req->master_bio);
 
+		/* coalesced writes are never sent with a digest */
+		for (i = 0; i < n_more && !err; i++) {
+			if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)))
+				err = _drbd_send_bio(peer_device, more[i]->master_bio);
+			else
+				err = _drbd_send_zc_bio(peer_device, more[i]->master_bio);
+		}
+
 		/* double check digest, sometimes buffers have been modified in flight. */
 		if (digest_size > 0 && digest_size <= 64) {
 			/* 64 byte, 512 bit, is the largest digest size
@@ -2709,6 +2847,23 @@ static void drbd_destroy_mempools(void)
 
 	/* D_ASSERT(device, atomic_read(&drbd_pp_vacant)==0); */
 
+	if (drbd_pp_cache) {
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct drbd_pp_cache *pcp = per_cpu_ptr(drbd_pp_cache, cpu);
+
+			while (pcp->pool) {
+				page = pcp->pool;
+				pcp->pool = page_chain_next(page);
+				__free_page(page);
+			}
+			pcp->vacant = 0;
+		}
+		free_percpu(drbd_pp_cache);
+		drbd_pp_cache = NULL;
+	}
+
 	if (drbd_io_bio_set)
 		bioset_free(drbd_io_bio_set);
 	if (drbd_md_io_bio_set)
@@ -2754,6 +2909,7 @@ static int drbd_create_mempools(void)
 	drbd_bm_ext_cache    = NULL;
 	drbd_al_ext_cache    = NULL;
 	drbd_pp_pool         = NULL;
+	drbd_pp_cache        = NULL;
 	drbd_md_io_page_pool = NULL;
 	drbd_md_io_bio_set   = NULL;
 	drbd_io_bio_set      = NULL;
@@ -2765,7 +2921,7 @@ static int drbd_create_mempools(void)
 		goto Enomem;
 
 	drbd_ee_cache = kmem_cache_create(
-		"drbd_ee", sizeof(struct drbd_peer_request), 0, 0, NULL);
+		"drbd_ee", sizeof(struct drbd_peer_request), 0, 0, drbd_peer_req_ctor);
 	if (drbd_ee_cache == NULL)
 		goto Enomem;
 
@@ -2804,6 +2960,12 @@ static int drbd_create_mempools(void)
 	/* drbd's page pool */
 	spin_lock_init(&drbd_pp_lock);
 
+	drbd_pp_cache = alloc_percpu(struct drbd_pp_cache);
+	if (drbd_pp_cache == NULL)
+		goto Enomem;
+	for_each_possible_cpu(i)
+		spin_lock_init(&per_cpu_ptr(drbd_pp_cache, i)->lock);
+
 	for (i = 0; i < number; i++) {
 		page = alloc_page(GFP_HIGHUSER);
 		if (!page)
@@ -2836,6 +2998,8 @@ static void drbd_device_finalize_work_fn(struct work_struct *work)
 	if (device->this_bdev)
 		bdput(device->this_bdev);
 
+	drbd_csum_cache_destroy(device);
+	drbd_interval_index_free(&device->write_index);
 	drbd_backing_dev_free(device, device->ldev);
 	device->ldev = NULL;
 
@@ -3020,6 +3184,8 @@ static void drbd_cleanup(void)
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
 
+	drbd_digest_cleanup();
+
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
 
@@ -3310,6 +3476,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	INIT_LIST_HEAD(&resource->transfer_log);
 	INIT_LIST_HEAD(&resource->peer_ack_list);
 	setup_timer(&resource->peer_ack_timer, peer_ack_timer_fn, (unsigned long) resource);
+	resource->peer_ack_ctl.period_start_jif = jiffies;
 	setup_timer(&resource->repost_up_to_date_timer, repost_up_to_date_fn, (unsigned long) resource);
 	sema_init(&resource->state_sem, 1);
 	resource->role[NOW] = R_SECONDARY;
@@ -3498,6 +3665,7 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	peer_device->disk_state[NOW] = D_UNKNOWN;
 	peer_device->repl_state[NOW] = L_OFF;
 	spin_lock_init(&peer_device->peer_seq_lock);
+	spin_lock_init(&peer_device->rs_model_lock);
 
 	err = drbd_create_peer_device_default_config(peer_device);
 	if (err) {
@@ -3511,6 +3679,8 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 
 	INIT_LIST_HEAD(&peer_device->resync_work.list);
 	peer_device->resync_work.cb  = w_resync_timer;
+	INIT_LIST_HEAD(&peer_device->resync_refill_work.list);
+	peer_device->resync_refill_work.cb = w_resync_refill;
 	setup_timer(&peer_device->resync_timer,
 			resync_timer_fn,
 			(unsigned long) peer_device);
@@ -3598,6 +3768,8 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 
 	spin_lock_init(&device->timing_lock);
 	spin_lock_init(&device->al_lock);
+	spin_lock_init(&device->flush.lock);
+	init_waitqueue_head(&device->flush.wait);
 	mutex_init(&device->bm_resync_fo_mutex);
 
 	INIT_LIST_HEAD(&device->pending_master_completion[0]);
@@ -3666,6 +3838,8 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 		goto out_no_bitmap;
 	device->read_requests = RB_ROOT;
 	device->write_requests = RB_ROOT;
+	/* without the index, conflict detection walks the tree every time */
+	drbd_interval_index_init(&device->write_index);
 
 	BUG_ON(!mutex_is_locked(&resource->conf_update));
 	for_each_connection(connection, resource) {
@@ -3772,6 +3946,7 @@ out_no_peer_device:
 		kfree(peer_device);
 	}
 
+	drbd_interval_index_free(&device->write_index);
 	drbd_bm_free(device->bitmap);
 out_no_bitmap:
 	__free_page(device->md_io.page);
@@ -3959,6 +4134,11 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	if (drbd_digest_init()) {
+		pr_err("unable to create digest workqueue\n");
+		goto fail;
+	}
+
 	if (drbd_debugfs_init())
 		pr_notice("failed to initialize debugfs -- will not be available\n");
 
@@ -3978,6 +4158,170 @@ fail:
 	return err;
 }
 
+static LIST_HEAD(alloc_providers);
+static DECLARE_RWSEM(alloc_providers_lock);
+
+int drbd_register_alloc_provider(struct drbd_alloc_provider *provider)
+{
+	down_write(&alloc_providers_lock);
+	list_add_tail(&provider->list, &alloc_providers);
+	up_write(&alloc_providers_lock);
+	pr_info("allocation map provider '%s' registered\n", provider->name);
+	return 0;
+}
+
+void drbd_unregister_alloc_provider(struct drbd_alloc_provider *provider)
+{
+	down_write(&alloc_providers_lock);
+	list_del_init(&provider->list);
+	up_write(&alloc_providers_lock);
+}
+
+/**
+ * drbd_zeroed_add() - Remember a range of the backing device that reads back zeroes
+ * @ldev:	Backing device.
+ * @sector:	Start of the range.
+ * @nr_sectors:	Size of the range, in sectors.
+ *
+ * Called after we zeroed out or unmapped the range.  Adjacent and
+ * overlapping ranges are merged.  If all slots are in use, the smallest
+ * range is forgotten.
+ */
+void drbd_zeroed_add(struct drbd_backing_dev *ldev, sector_t sector, unsigned int nr_sectors)
+{
+	struct drbd_zeroed_ranges *z = &ldev->zeroed;
+	sector_t end = sector + nr_sectors;
+	unsigned int i, smallest = 0;
+	unsigned long flags;
+
+	if (!nr_sectors)
+		return;
+
+	spin_lock_irqsave(&z->lock, flags);
+	for (i = 0; i < z->nr; ) {
+		if (z->r[i].sector <= end && sector <= z->r[i].end) {
+			sector = min(sector, z->r[i].sector);
+			end = max(end, z->r[i].end);
+			z->r[i] = z->r[--z->nr];
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+	if (z->nr < DRBD_ZEROED_RANGES) {
+		i = z->nr++;
+	} else {
+		for (i = 1; i < z->nr; i++)
+			if (z->r[i].end - z->r[i].sector < z->r[smallest].end - z->r[smallest].sector)
+				smallest = i;
+		if (z->r[smallest].end - z->r[smallest].sector >= end - sector)
+			goto out;
+		i = smallest;
+	}
+	z->r[i].sector = sector;
+	z->r[i].end = end;
+out:
+	spin_unlock_irqrestore(&z->lock, flags);
+}
+
+/**
+ * drbd_zeroed_forget() - A range of the backing device is about to be written
+ * @ldev:	Backing device.
+ * @sector:	Start of the range.
+ * @nr_sectors:	Size of the range, in sectors.
+ */
+void drbd_zeroed_forget(struct drbd_backing_dev *ldev, sector_t sector, unsigned int nr_sectors)
+{
+	struct drbd_zeroed_ranges *z = &ldev->zeroed;
+	sector_t end = sector + nr_sectors;
+	unsigned long flags;
+	unsigned int i;
+
+	if (!READ_ONCE(z->nr))
+		return;
+
+	spin_lock_irqsave(&z->lock, flags);
+	for (i = 0; i < z->nr; ) {
+		if (end <= z->r[i].sector || z->r[i].end <= sector) {
+			i++;
+			continue;
+		}
+		if (sector > z->r[i].sector && end < z->r[i].end) {
+			/* split; without a free slot keep the larger part */
+			if (z->nr < DRBD_ZEROED_RANGES) {
+				z->r[z->nr].sector = end;
+				z->r[z->nr++].end = z->r[i].end;
+				z->r[i].end = sector;
+			} else if (sector - z->r[i].sector < z->r[i].end - end) {
+				z->r[i].sector = end;
+			} else {
+				z->r[i].end = sector;
+			}
+			i++;
+		} else if (sector > z->r[i].sector) {
+			z->r[i++].end = sector;
+		} else if (end < z->r[i].end) {
+			z->r[i++].sector = end;
+		} else {
+			z->r[i] = z->r[--z->nr];
+		}
+	}
+	spin_unlock_irqrestore(&z->lock, flags);
+}
+
+static bool drbd_zeroed_contains(struct drbd_backing_dev *ldev, sector_t sector, unsigned int size)
+{
+	struct drbd_zeroed_ranges *z = &ldev->zeroed;
+	sector_t end = sector + (size >> 9);
+	unsigned long flags;
+	bool rv = false;
+	unsigned int i;
+
+	if (!READ_ONCE(z->nr))
+		return false;
+
+	spin_lock_irqsave(&z->lock, flags);
+	for (i = 0; i < z->nr; i++) {
+		if (z->r[i].sector <= sector && end <= z->r[i].end) {
+			rv = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&z->lock, flags);
+	return rv;
+}
+
+/**
+ * drbd_range_allocated() - Ask the allocation map providers about a range
+ * @device:	DRBD device.
+ * @sector:	Start of the range.
+ * @size:	Size of the range, in bytes.
+ *
+ * Returns false if we zeroed or unmapped the range ourselves and did not
+ * write it since, or if a provider knows the backing device and says no
+ * part of the range is allocated, that is it reads as zeroes.
+ * Caller needs to hold a reference on the local disk.
+ */
+bool drbd_range_allocated(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct block_device *bdev = device->ldev->backing_bdev;
+	struct drbd_alloc_provider *provider;
+	int allocated = -ENODEV;
+
+	if (drbd_zeroed_contains(device->ldev, sector, size))
+		return false;
+
+	down_read(&alloc_providers_lock);
+	list_for_each_entry(provider, &alloc_providers, list) {
+		allocated = provider->range_allocated(bdev, sector, size);
+		if (allocated >= 0)
+			break;
+	}
+	up_read(&alloc_providers_lock);
+
+	return allocated != 0;
+}
+
 /* meta data management */
 
 void drbd_md_write(struct drbd_device *device, void *b)
@@ -5360,3 +5704,7 @@ module_exit(drbd_cleanup)
 /* For transport layer */
 EXPORT_SYMBOL(drbd_destroy_connection);
 EXPORT_SYMBOL(drbd_destroy_path);
+
+/* For allocation map providers */
+EXPORT_SYMBOL_GPL(drbd_register_alloc_provider);
+EXPORT_SYMBOL_GPL(drbd_unregister_alloc_provider);
@@ -1835,6 +1835,18 @@ static void fixup_discard_if_not_supported(struct request_queue *q)
 	}
 }
 
+static void fixup_write_zeroes(struct drbd_device *device, struct request_queue *q)
+{
+#ifdef COMPAT_HAVE_REQ_OP_WRITE_ZEROES
+	/* If all peers execute zero-out natively (P_ZEROES), announce
+	 * WRITE_ZEROES even if the backend does not, or discards are disabled.
+	 * Locally, blkdev_issue_zeroout() falls back to writing zeroes,
+	 * but only the sector range goes over the network. */
+	if (common_connection_features(device->resource) & DRBD_FF_WZEROES)
+		q->limits.max_write_zeroes_sectors = drbd_max_discard_sectors(device->resource);
+#endif
+}
+
 static void decide_on_write_same_support(struct drbd_device *device,
 			struct request_queue *q,
 			struct request_queue *b, struct o_qlim *o,
@@ -1936,6 +1948,7 @@ static void drbd_setup_queue_param(struct drbd_device *device, struct drbd_backi
 		adjust_ra_pages(q, b);
 	}
 	fixup_discard_if_not_supported(q);
+	fixup_write_zeroes(device, q);
 }
 
 void drbd_reconsider_queue_parameters(struct drbd_device *device, struct drbd_backing_dev *bdev, struct o_qlim *o)
@@ -2415,6 +2428,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 		goto fail;
 	}
 	spin_lock_init(&nbc->md.uuid_lock);
+	spin_lock_init(&nbc->zeroed.lock);
 
 	new_disk_conf = kzalloc(sizeof(struct disk_conf), GFP_KERNEL);
 	if (!new_disk_conf) {
@@ -2653,6 +2667,9 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	nbc = NULL;
 	new_disk_conf = NULL;
 
+	if (drbd_csum_cache_create(device, drbd_csum_cache_entries))
+		drbd_warn(device, "Could not allocate the csum cache, continuing without\n");
+
 	for_each_peer_device(peer_device, device) {
 		err = drbd_attach_peer_device(peer_device);
 		if (err) {
@@ -47,9 +47,10 @@
 #include "drbd_protocol.h"
 #include "drbd_req.h"
 #include "drbd_vli.h"
+#include "drbd_trace.h"
 #include <linux/scatterlist.h>
 
-#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME)
+#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_WZEROES|DRBD_FF_OV_TREE|DRBD_FF_ACK_BATCH)
 
 struct flush_work {
 	struct drbd_work w;
@@ -174,14 +175,105 @@ static void page_chain_add(struct page **head,
 	*head = chain_first;
 }
 
+/* Takes @number pages from the cache of this CPU, refilling it with a batch
+ * from drbd_pp_pool first if necessary.  Returns NULL if there are not
+ * enough. */
+static struct page *drbd_pp_cache_get(unsigned int number)
+{
+	struct drbd_pp_cache *pcp;
+	struct page *page = NULL;
+
+	if (number > DRBD_PP_BATCH)
+		return NULL;
+
+	pcp = get_cpu_ptr(drbd_pp_cache);
+	spin_lock(&pcp->lock);
+	if (pcp->vacant < number && drbd_pp_vacant >= DRBD_PP_BATCH) {
+		struct page *chain;
+
+		spin_lock(&drbd_pp_lock);
+		chain = page_chain_del(&drbd_pp_pool, DRBD_PP_BATCH);
+		if (chain)
+			drbd_pp_vacant -= DRBD_PP_BATCH;
+		spin_unlock(&drbd_pp_lock);
+		if (chain) {
+			page_chain_add(&pcp->pool, chain, page_chain_tail(chain, NULL));
+			pcp->vacant += DRBD_PP_BATCH;
+		}
+	}
+	if (pcp->vacant >= number) {
+		page = page_chain_del(&pcp->pool, number);
+		pcp->vacant -= number;
+	}
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(drbd_pp_cache);
+	return page;
+}
+
+/* Adds a chain of at most DRBD_PP_BATCH pages to the cache of this CPU.
+ * Once it holds more than two batches, one batch goes back to drbd_pp_pool. */
+static void drbd_pp_cache_put(struct page *page, struct page *tail, int number)
+{
+	struct drbd_pp_cache *pcp = get_cpu_ptr(drbd_pp_cache);
+
+	spin_lock(&pcp->lock);
+	page_chain_add(&pcp->pool, page, tail);
+	pcp->vacant += number;
+	if (pcp->vacant > 2 * DRBD_PP_BATCH) {
+		struct page *chain = page_chain_del(&pcp->pool, DRBD_PP_BATCH);
+
+		pcp->vacant -= DRBD_PP_BATCH;
+		spin_lock(&drbd_pp_lock);
+		page_chain_add(&drbd_pp_pool, chain, page_chain_tail(chain, NULL));
+		drbd_pp_vacant += DRBD_PP_BATCH;
+		spin_unlock(&drbd_pp_lock);
+	}
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(drbd_pp_cache);
+}
+
+/* Empties the caches of all CPUs into drbd_pp_pool.  Called when that cannot
+ * satisfy an allocation: the emergency reserve must not sit unused in the
+ * caches of other CPUs, while we fall back to alloc_page() or wait. */
+static void drbd_pp_cache_drain(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_pp_cache *pcp = per_cpu_ptr(drbd_pp_cache, cpu);
+		struct page *chain;
+		int number;
+
+		spin_lock(&pcp->lock);
+		chain = pcp->pool;
+		number = pcp->vacant;
+		pcp->pool = NULL;
+		pcp->vacant = 0;
+		spin_unlock(&pcp->lock);
+		if (!chain)
+			continue;
+
+		spin_lock(&drbd_pp_lock);
+		page_chain_add(&drbd_pp_pool, chain, page_chain_tail(chain, NULL));
+		drbd_pp_vacant += number;
+		spin_unlock(&drbd_pp_lock);
+	}
+}
+
 static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 {
 	struct page *page = NULL;
 	struct page *tmp = NULL;
 	unsigned int i = 0;
 
+	page = drbd_pp_cache_get(number);
+	if (page)
+		return page;
+
 	/* Yes, testing drbd_pp_vacant outside the lock is racy.
 	 * So what. It saves a spin_lock. */
+	if (drbd_pp_vacant < number)
+		drbd_pp_cache_drain();
 	if (drbd_pp_vacant >= number) {
 		spin_lock(&drbd_pp_lock);
 		page = page_chain_del(&drbd_pp_pool, number);
@@ -216,6 +308,56 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 	return NULL;
 }
 
+/* Compound pages of order large_page_order for @number pages, and order 0
+ * pages for the remainder.  Does not wait, and gives up when max-buffers is
+ * reached or no compound pages are available right away; the caller then
+ * falls back to order 0 pages. */
+static struct page *drbd_alloc_large_pages(struct drbd_connection *connection,
+					   unsigned int number, gfp_t gfp_mask)
+{
+	unsigned int order = min_t(unsigned int, drbd_large_page_order, DRBD_MAX_LARGE_PAGE_ORDER);
+	unsigned int n = 1U << order, i, mxb;
+	struct page *page = NULL, *tail = NULL, *tmp;
+
+	if (!order || number < n)
+		return NULL;
+
+	rcu_read_lock();
+	mxb = rcu_dereference(connection->transport.net_conf)->max_buffers;
+	rcu_read_unlock();
+	if (atomic_read(&connection->pp_in_use) + number > mxb)
+		return NULL;
+
+	/* no highmem, so that kmap() of the head maps the whole page */
+	gfp_mask = (gfp_mask & ~(__GFP_HIGHMEM | __GFP_RECLAIM)) |
+		__GFP_COMP | __GFP_NOWARN | __GFP_NORETRY;
+	for (i = 0; i < number / n; i++) {
+		tmp = alloc_pages(gfp_mask, order);
+		if (!tmp)
+			goto fail;
+		set_page_chain_next_offset_size(tmp, NULL, 0, 0);
+		if (tail)
+			set_page_chain_next(tail, tmp);
+		else
+			page = tmp;
+		tail = tmp;
+	}
+	if (number % n) {
+		tmp = __drbd_alloc_pages(number % n, gfp_mask & ~__GFP_COMP);
+		if (!tmp)
+			goto fail;
+		set_page_chain_next(tail, tmp);
+	}
+
+	atomic_add(number, &connection->pp_in_use);
+	return page;
+
+fail:
+	if (page)
+		page_chain_free(page);
+	return NULL;
+}
+
 /* kick lower level device, if we have more than (arbitrary number)
  * reference counts on it, which typically are locally submitted io
  * requests.  don't use unacked_cnt, so we speed up proto A and B, too. */
@@ -298,6 +440,10 @@ static void conn_maybe_kick_lo(struct drbd_connection *connection)
  * (checksum based) resync, if the max-buffers, socket buffer sizes and
  * resync-rate settings are mis-configured.
  *
+ * With __GFP_COMP in @gfp_mask, the caller can deal with compound pages in
+ * the chain, see page_chain_room().  If large_page_order is set, those are
+ * used when available.  @number always counts order 0 pages.
+ *
  * Returns a page chain linked via (struct drbd_page_chain*)&page->lru.
  */
 struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int number,
@@ -309,6 +455,13 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 	DEFINE_WAIT(wait);
 	unsigned int mxb;
 
+	if (gfp_mask & __GFP_COMP) {
+		page = drbd_alloc_large_pages(connection, number, gfp_mask);
+		if (page)
+			return page;
+		gfp_mask &= ~__GFP_COMP;
+	}
+
 	rcu_read_lock();
 	mxb = rcu_dereference(transport->net_conf)->max_buffers;
 	rcu_read_unlock();
@@ -360,26 +513,45 @@ void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is
 	struct drbd_connection *connection =
 		container_of(transport, struct drbd_connection, transport);
 	atomic_t *a = is_net ? &connection->pp_in_use_by_net : &connection->pp_in_use;
-	int i;
+	int i, large = 0;
 
 	if (page == NULL)
 		return;
 
-	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count)
+	/* compound pages come first in a chain, and go back to the system */
+	while (page && PageCompound(page)) {
+		struct page *tmp = page_chain_next(page);
+
+		large += 1 << compound_order(page);
+		set_page_chain_next_offset_size(page, NULL, 0, 0);
+		put_page(page);
+		page = tmp;
+	}
+
+	if (page == NULL)
+		i = 0;
+	else if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count)
 		i = page_chain_free(page);
 	else {
 		struct page *tmp;
 		tmp = page_chain_tail(page, &i);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
+		if (i <= DRBD_PP_BATCH)
+			drbd_pp_cache_put(page, tmp, i);
+		else {
+			spin_lock(&drbd_pp_lock);
+			page_chain_add(&drbd_pp_pool, page, tmp);
+			drbd_pp_vacant += i;
+			spin_unlock(&drbd_pp_lock);
+		}
 	}
-	i = atomic_sub_return(i, a);
+	i = atomic_sub_return(i + large, a);
 	if (i < 0)
 		drbd_warn(connection, "ASSERTION FAILED: %s: %d < 0\n",
 			is_net ? "pp_in_use_by_net" : "pp_in_use", i);
-	wake_up(&drbd_pp_wait);
+	/* atomic_sub_return() implies a full barrier, pairing with the
+	 * one in prepare_to_wait() in drbd_alloc_pages() */
+	if (waitqueue_active(&drbd_pp_wait))
+		wake_up(&drbd_pp_wait);
 }
 
 /*
@@ -415,15 +587,42 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, gfp_t gfp_mask) __must
 		return NULL;
 	}
 
+	/* List heads, the interval node and pending_bios are as
+	 * drbd_peer_req_ctor() set them up, see __drbd_free_peer_req(). */
+	peer_req->w.cb = NULL;
+	peer_req->peer_device = peer_device;
+	peer_req->page_chain.head = NULL;
+	peer_req->page_chain.nr_pages = 0;
+	peer_req->op_flags = 0;
+	peer_req->i.sector = 0;
+	peer_req->i.size = 0;
+	peer_req->i.end = 0;
+	peer_req->i.local = 0;
+	peer_req->i.waiting = 0;
+	peer_req->i.completed = 0;
+	peer_req->flags = 0;
+	/* also covers the send_oos_* members of the union */
+	peer_req->epoch = NULL;
+	peer_req->submit_jif = jiffies;
+	peer_req->block_id = 0;
+	peer_req->dagtag_sector = 0;
+	peer_req->csum_cache_seq = 0;
+
+	return peer_req;
+}
+
+/* Constructor of drbd_ee_cache objects.  The invariant part is restored by
+ * __drbd_free_peer_req(), so objects coming back from the slab (or from
+ * drbd_ee_mempool) need not be cleared entirely on every allocation. */
+void drbd_peer_req_ctor(void *obj)
+{
+	struct drbd_peer_request *peer_req = obj;
+
 	memset(peer_req, 0, sizeof(*peer_req));
 	INIT_LIST_HEAD(&peer_req->w.list);
 	drbd_clear_interval(&peer_req->i);
 	INIT_LIST_HEAD(&peer_req->recv_order);
 	INIT_LIST_HEAD(&peer_req->wait_for_actlog);
-	peer_req->submit_jif = jiffies;
-	peer_req->peer_device = peer_device;
-
-	return peer_req;
 }
 
 void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
@@ -436,6 +635,13 @@ void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
 	D_ASSERT(peer_device, drbd_interval_empty(&peer_req->i));
 	drbd_free_page_chain(&peer_device->connection->transport, &peer_req->page_chain, is_net);
+
+	/* back to the state drbd_peer_req_ctor() left it in */
+	INIT_LIST_HEAD(&peer_req->w.list);
+	drbd_clear_interval(&peer_req->i);
+	INIT_LIST_HEAD(&peer_req->recv_order);
+	INIT_LIST_HEAD(&peer_req->wait_for_actlog);
+	atomic_set(&peer_req->pending_bios, 0);
 	mempool_free(peer_req, drbd_ee_mempool);
 }
 
@@ -456,6 +662,91 @@ int drbd_free_peer_reqs(struct drbd_resource *resource, struct list_head *list,
 	return count;
 }
 
+/* Number of write acks to batch into one P_ACK_BATCH, or 0.  Not with two
+ * primaries, there the sequence numbers of the acks order them relative to
+ * conflicting writes of this node, see wait_for_and_update_peer_seq(). */
+static unsigned int ack_batch_max(struct drbd_connection *connection)
+{
+	unsigned int max = min_t(unsigned int, drbd_ack_batch_size, DRBD_ACK_BATCH_MAX);
+	bool two_primaries;
+
+	if (max < 2 || !(connection->agreed_features & DRBD_FF_ACK_BATCH))
+		return 0;
+
+	rcu_read_lock();
+	two_primaries = rcu_dereference(connection->transport.net_conf)->two_primaries;
+	rcu_read_unlock();
+
+	return two_primaries ? 0 : max;
+}
+
+static int flush_ack_batch(struct drbd_connection *connection)
+{
+	struct drbd_ack_batch *b = &connection->ack_batch;
+	struct drbd_peer_device *peer_device = b->peer_device;
+	unsigned int i, n = b->count;
+	struct p_ack_batch *p;
+	int err = -EIO;
+
+	if (!n)
+		return 0;
+	b->count = 0;
+
+	if (peer_device->repl_state[NOW] >= L_ESTABLISHED) {
+		p = drbd_prepare_command(peer_device, sizeof(*p) + n * sizeof(p->ack[0]),
+					 CONTROL_STREAM);
+		if (p) {
+			p->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
+			p->cmd = cpu_to_be16(b->cmd);
+			p->count = cpu_to_be16(n);
+			memcpy(p->ack, b->ack, n * sizeof(p->ack[0]));
+#if DRBD_FF_ACK_BATCH
+			err = drbd_send_command(peer_device, P_ACK_BATCH, CONTROL_STREAM);
+#endif
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		dec_unacked(peer_device);
+		if (b->epoch[i])
+			drbd_may_finish_epoch(connection, b->epoch[i],
+					      EV_PUT + (b->cleanup[i] ? EV_CLEANUP : 0));
+	}
+	return err;
+}
+
+/* Instead of sending the ack for peer_req right away, add it to the batch.
+ * The batch takes over the dec_unacked() and, if epoch is given, the EV_PUT
+ * of epoch. */
+static int queue_batched_ack(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
+			     struct drbd_peer_request *peer_req,
+			     struct drbd_epoch *epoch, int cancel)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_ack_batch *b = &connection->ack_batch;
+	unsigned int i;
+	int err = 0, err2;
+
+	if (b->count && (b->peer_device != peer_device || b->cmd != cmd))
+		err = flush_ack_batch(connection);
+
+	i = b->count++;
+	b->peer_device = peer_device;
+	b->cmd = cmd;
+	b->ack[i].sector = cpu_to_be64(peer_req->i.sector);
+	b->ack[i].block_id = peer_req->block_id;
+	b->ack[i].blksize = cpu_to_be32(peer_req->i.size);
+	b->epoch[i] = epoch;
+	b->cleanup[i] = cancel;
+
+	if (b->count >= b->max) {
+		err2 = flush_ack_batch(connection);
+		if (!err)
+			err = err2;
+	}
+	return err;
+}
+
 /*
  * See also comments in _req_mod(,BARRIER_ACKED) and receive_Barrier.
  */
@@ -467,6 +758,8 @@ static int drbd_finish_peer_reqs(struct drbd_connection *connection)
 	int err = 0;
 	int n = 0;
 
+	connection->ack_batch.max = ack_batch_max(connection);
+
 	spin_lock_irq(&connection->resource->req_lock);
 	reclaim_finished_net_peer_reqs(connection, &reclaimed);
 	list_splice_init(&connection->done_ee, &work_list);
@@ -492,6 +785,13 @@ static int drbd_finish_peer_reqs(struct drbd_connection *connection)
 		} else
 			drbd_free_peer_req(peer_req);
 	}
+	if (connection->ack_batch.max) {
+		int err2 = flush_ack_batch(connection);
+
+		if (!err)
+			err = err2;
+		connection->ack_batch.max = 0;
+	}
 	if (atomic_sub_and_test(n, &connection->done_ee_cnt))
 		wake_up(&connection->ee_wait);
 
@@ -932,99 +1232,198 @@ static int drbd_recv_header_maybe_unplug(struct drbd_connection *connection, str
 	return err;
 }
 
-/* This is blkdev_issue_flush, but asynchronous.
- * We want to submit to all component volumes in parallel,
- * then wait for all completions.
- */
-struct issue_flush_context {
-	atomic_t pending;
-	int error;
-	struct completion done;
-};
-struct one_flush_context {
-	struct drbd_device *device;
-	struct issue_flush_context *ctx;
-};
+static void drbd_flush_done(struct drbd_device *device, int error)
+{
+	struct drbd_flush_state *fs = &device->flush;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fs->lock, flags);
+	fs->done = fs->started;
+	fs->error = error;
+	if (!error) {
+		fs->flushed_writes = fs->in_flight_writes;
+		fs->have_flushed = true;
+	}
+	fs->in_flight = false;
+	clear_bit(FLUSH_PENDING, &device->flags);
+	spin_unlock_irqrestore(&fs->lock, flags);
+
+	wake_up_all(&fs->wait);
+}
 
-static void one_flush_endio BIO_ENDIO_ARGS(struct bio *bio)
+static void drbd_flush_endio BIO_ENDIO_ARGS(struct bio *bio)
 {
-	struct one_flush_context *octx = bio->bi_private;
-	struct drbd_device *device = octx->device;
-	struct issue_flush_context *ctx = octx->ctx;
+	struct drbd_device *device = bio->bi_private;
 
 	BIO_ENDIO_FN_START;
 
-	if (status) {
-		ctx->error = blk_status_to_errno(status);
+	if (status)
 		drbd_info(device, "local disk FLUSH FAILED with status %d\n", status);
-	}
-	kfree(octx);
 	bio_put(bio);
 
-	clear_bit(FLUSH_PENDING, &device->flags);
+	drbd_flush_done(device, status ? blk_status_to_errno(status) : 0);
+
+	/* the waiters may be gone already, see drbd_flush_submit() */
 	put_ldev(device);
 	kref_debug_put(&device->kref_debug, 7);
 	kref_put(&device->kref, drbd_destroy_device);
+}
 
-	if (atomic_dec_and_test(&ctx->pending))
-		complete(&ctx->done);
+/* Called with fs->lock held, if no flush is in flight.
+ * The caller then calls drbd_flush_submit(). */
+static unsigned int __drbd_flush_claim(struct drbd_flush_state *fs)
+{
+	fs->in_flight = true;
+	fs->in_flight_writes = atomic_read(&fs->writes);
+	fs->issued++;
+	return ++fs->started;
 }
 
-static void submit_one_flush(struct drbd_device *device, struct issue_flush_context *ctx)
+/* Called by a waiter, which holds references on the device and the local
+ * disk.  A woken waiter may drop those before drbd_flush_endio() is done
+ * with the device, so the bio holds its own. */
+static void drbd_flush_submit(struct drbd_device *device)
 {
-	struct bio *bio = bio_alloc(GFP_NOIO, 0);
-	struct one_flush_context *octx = kmalloc(sizeof(*octx), GFP_NOIO);
-	if (!bio || !octx) {
+	struct bio *bio;
+
+	if (!get_ldev(device)) {
+		drbd_flush_done(device, -ENODEV);
+		return;
+	}
+	kref_get(&device->kref);
+	kref_debug_get(&device->kref_debug, 7);
+
+	bio = bio_alloc(GFP_NOIO, 0);
+	if (!bio) {
 		drbd_warn(device, "Could not allocate a bio, CANNOT ISSUE FLUSH\n");
 		/* FIXME: what else can I do now?  disconnecting or detaching
 		 * really does not help to improve the state of the world, either.
 		 */
-		kfree(octx);
-		if (bio)
-			bio_put(bio);
-
-		ctx->error = -ENOMEM;
+		drbd_flush_done(device, -ENOMEM);
 		put_ldev(device);
 		kref_debug_put(&device->kref_debug, 7);
 		kref_put(&device->kref, drbd_destroy_device);
 		return;
 	}
 
-	octx->device = device;
-	octx->ctx = ctx;
 	bio_set_dev(bio, device->ldev->backing_bdev);
-	bio->bi_private = octx;
-	bio->bi_end_io = one_flush_endio;
+	bio->bi_private = device;
+	bio->bi_end_io = drbd_flush_endio;
 
 	device->flush_jif = jiffies;
 	set_bit(FLUSH_PENDING, &device->flags);
-	atomic_inc(&ctx->pending);
 	bio_set_op_attrs(bio, REQ_OP_FLUSH, WRITE_FLUSH);
 	submit_bio(bio);
 }
 
+/**
+ * drbd_flush_request() - Ask for a flush covering all writes completed so far
+ * @device:	DRBD device.
+ * @ticket:	Generation of that flush, to pass to drbd_flush_wait().
+ *
+ * Submits a flush, unless one in flight or the last completed one already
+ * covers all completed writes, or one is in flight that does not, in which
+ * case the next one is shared by everyone asking in the meantime.
+ * Returns false if there is nothing to wait for.
+ */
+static bool drbd_flush_request(struct drbd_device *device, unsigned int *ticket)
+{
+	struct drbd_flush_state *fs = &device->flush;
+	bool submit = false, wait = true;
+	int writes;
+
+	spin_lock_irq(&fs->lock);
+	writes = atomic_read(&fs->writes);
+	fs->requested++;
+	if (fs->in_flight) {
+		*ticket = fs->started + (fs->in_flight_writes == writes ? 0 : 1);
+	} else if (fs->have_flushed && fs->flushed_writes == writes) {
+		fs->skipped++;
+		wait = false;
+	} else {
+		*ticket = __drbd_flush_claim(fs);
+		submit = true;
+	}
+	spin_unlock_irq(&fs->lock);
+
+	if (submit)
+		drbd_flush_submit(device);
+	return wait;
+}
+
+/* Waits for flush generation @ticket, submitting it if it was requested
+ * while its predecessor was in flight.  Returns the error of the last
+ * flush completed. */
+static int drbd_flush_wait(struct drbd_device *device, unsigned int ticket)
+{
+	struct drbd_flush_state *fs = &device->flush;
+
+	for (;;) {
+		bool submit = false;
+		int err;
+
+		wait_event(fs->wait, !READ_ONCE(fs->in_flight) ||
+			   (int)(READ_ONCE(fs->done) - ticket) >= 0);
+
+		spin_lock_irq(&fs->lock);
+		if ((int)(fs->done - ticket) >= 0) {
+			err = fs->error;
+			spin_unlock_irq(&fs->lock);
+			return err;
+		}
+		if (!fs->in_flight) {
+			__drbd_flush_claim(fs);
+			submit = true;
+		}
+		spin_unlock_irq(&fs->lock);
+
+		if (submit)
+			drbd_flush_submit(device);
+	}
+}
+
+struct one_flush_context {
+	struct list_head list;
+	struct drbd_device *device;
+	unsigned int ticket;
+};
+
 static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connection, struct drbd_epoch *epoch)
 {
 	struct drbd_resource *resource = connection->resource;
 
 	if (resource->write_ordering >= WO_BDEV_FLUSH) {
+		struct one_flush_context *octx, *tmp;
 		struct drbd_device *device;
-		struct issue_flush_context ctx;
-		int vnr;
-
-		atomic_set(&ctx.pending, 1);
-		ctx.error = 0;
-		init_completion(&ctx.done);
+		LIST_HEAD(pending);
+		int vnr, err = 0;
 
+		/* Submit to all component volumes in parallel,
+		 * then wait for all completions. */
 		rcu_read_lock();
 		idr_for_each_entry(&resource->devices, device, vnr) {
+			unsigned int ticket;
+
 			if (!get_ldev(device))
 				continue;
 			kref_get(&device->kref);
 			kref_debug_get(&device->kref_debug, 7);
 			rcu_read_unlock();
 
-			submit_one_flush(device, &ctx);
+			if (drbd_flush_request(device, &ticket)) {
+				octx = kmalloc(sizeof(*octx), GFP_NOIO);
+				if (octx) {
+					octx->device = device;
+					octx->ticket = ticket;
+					list_add_tail(&octx->list, &pending);
+					rcu_read_lock();
+					continue;
+				}
+				err = drbd_flush_wait(device, ticket) ?: err;
+			}
+			put_ldev(device);
+			kref_debug_put(&device->kref_debug, 7);
+			kref_put(&device->kref, drbd_destroy_device);
 
 			rcu_read_lock();
 		}
@@ -1032,10 +1431,17 @@ static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connecti
 
 		/* Do we want to add a timeout,
 		 * if disk-timeout is set? */
-		if (!atomic_dec_and_test(&ctx.pending))
-			wait_for_completion(&ctx.done);
+		list_for_each_entry_safe(octx, tmp, &pending, list) {
+			device = octx->device;
+			err = drbd_flush_wait(device, octx->ticket) ?: err;
+			put_ldev(device);
+			kref_debug_put(&device->kref_debug, 7);
+			kref_put(&device->kref, drbd_destroy_device);
+			kfree(octx);
+		}
 
-		if (ctx.error) {
+		/* -ENODEV: the local disk went away meanwhile, nothing to flush */
+		if (err && err != -ENODEV) {
 			/* would rather check on EOPNOTSUPP, but that is not reliable.
 			 * don't try again for ANY return value != 0
 			 * if (rv == -EOPNOTSUPP) */
@@ -1265,16 +1671,28 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
  * At least for LVM/DM thin, the result is effectively "discard_zeroes_data=1".
  */
 #ifdef COMPAT_HAVE_REQ_OP_WRITE_ZEROES
-int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, unsigned int nr_sectors, bool discard)
+int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, unsigned int nr_sectors, bool discard, bool nounmap)
 {
-	/* Trust it to UNMAP if possible, and to zero-out the rest */
+	/* Trust it to UNMAP if possible, and to zero-out the rest,
+	 * unless the blocks must stay allocated */
 	struct block_device *bdev = device->ldev->backing_bdev;
-	return blkdev_issue_zeroout(bdev, start, nr_sectors, GFP_NOIO, 0) != 0;
+	int err;
+
+	drbd_zeroed_forget(device->ldev, start, nr_sectors);
+	err = blkdev_issue_zeroout(bdev, start, nr_sectors, GFP_NOIO,
+				   nounmap ? BLKDEV_ZERO_NOUNMAP : 0);
+	if (!err)
+		drbd_zeroed_add(device->ldev, start, nr_sectors);
+	return err != 0;
 }
 #else
-int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, unsigned int nr_sectors, bool discard)
+static bool can_do_reliable_discards(struct drbd_device *device);
+
+int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, unsigned int nr_sectors, bool discard, bool nounmap)
 {
 	struct block_device *bdev = device->ldev->backing_bdev;
+	sector_t zeroed_start = start;
+	unsigned int zeroed_nr = nr_sectors;
 #ifdef QUEUE_FLAG_DISCARD
 	struct request_queue *q = bdev_get_queue(bdev);
 	sector_t tmp, nr;
@@ -1283,6 +1701,7 @@ int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, u
 #endif
 	int err = 0;
 
+	drbd_zeroed_forget(device->ldev, start, nr_sectors);
 	if (!discard)
 		goto zero_out;
 
@@ -1328,6 +1747,8 @@ int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, u
 	if (nr_sectors) {
 		err |= blkdev_issue_zeroout(bdev, start, nr_sectors, GFP_NOIO, BLKDEV_ZERO_NOUNMAP);
 	}
+	if (!err && (!discard || can_do_reliable_discards(device)))
+		drbd_zeroed_add(device->ldev, zeroed_start, zeroed_nr);
 	return err != 0;
 }
 #endif
@@ -1365,7 +1786,8 @@ static void drbd_issue_peer_discard(struct drbd_device *device, struct drbd_peer
 		peer_req->flags |= EE_IS_TRIM_USE_ZEROOUT;
 
 	if (drbd_issue_discard_or_zero_out(device, peer_req->i.sector,
-	    peer_req->i.size >> 9, !(peer_req->flags & EE_IS_TRIM_USE_ZEROOUT)))
+	    peer_req->i.size >> 9, !(peer_req->flags & EE_IS_TRIM_USE_ZEROOUT),
+	    peer_req->flags & EE_ZEROOUT_NOUNMAP))
 		peer_req->flags |= EE_WAS_ERROR;
 	drbd_endio_write_sec_final(peer_req);
 }
@@ -1444,8 +1866,14 @@ int drbd_submit_peer_request(struct drbd_device *device,
 	unsigned data_size = peer_req->i.size;
 	unsigned n_bios = 0;
 	unsigned nr_pages = peer_req->page_chain.nr_pages;
+	unsigned done = 0; /* of the current chain element, for compound pages */
 	int err = -ENOMEM;
 
+	trace_drbd_peer_req_submit(peer_req);
+
+	if (op != REQ_OP_READ && !(peer_req->flags & EE_IS_TRIM))
+		drbd_zeroed_forget(device->ldev, sector, data_size >> 9);
+
 	/* TRIM/DISCARD: for now, always use the helper function
 	 * blkdev_issue_zeroout(..., discard=true).
 	 * It's synchronous, but it does the right thing wrt. bio splitting.
@@ -1516,41 +1944,50 @@ next_bio:
 	++n_bios;
 
 	page_chain_for_each(page) {
-		unsigned off, len;
-		int res;
+		unsigned off, len, room = page_chain_room(page);
 
-		if (op == REQ_OP_READ) {
+		if (op == REQ_OP_READ && !done) {
 			set_page_chain_offset(page, 0);
-			set_page_chain_size(page, min_t(unsigned, data_size, PAGE_SIZE));
+			set_page_chain_size(page, min_t(unsigned, data_size, room));
 		}
 		off = page_chain_offset(page);
 		len = page_chain_size(page);
 
-		if (off > PAGE_SIZE || len > PAGE_SIZE - off || len > data_size || len == 0) {
+		if (off > room || len > room - off || len - done > data_size || len == 0) {
 			drbd_err(device, "invalid page chain: offset %u size %u remaining data_size %u\n",
 					off, len, data_size);
 			err = -EINVAL;
 			goto fail;
 		}
 
-		res = bio_add_page(bio, page, len, off);
-		if (res <= 0) {
-			/* A single page must always be possible!
-			 * But in case it fails anyways,
-			 * we deal with it, and complain (below). */
-			if (bio->bi_vcnt == 0) {
-				drbd_err(device,
-					"bio_add_page(%p, %p, %u, %u): %d (bi_vcnt %u bi_max_vecs %u bi_sector %llu, bi_flags 0x%lx)\n",
-					bio, page, len, off, res, bio->bi_vcnt, bio->bi_max_vecs, (uint64_t)DRBD_BIO_BI_SECTOR(bio),
-					 (unsigned long)bio->bi_flags);
-				err = -ENOSPC;
-				goto fail;
+		/* one bio_vec per (sub-)page */
+		while (done < len) {
+			struct page *p = nth_page(page, (off + done) >> PAGE_SHIFT);
+			unsigned p_off = (off + done) & ~PAGE_MASK;
+			unsigned p_len = min_t(unsigned, len - done, PAGE_SIZE - p_off);
+			int res;
+
+			res = bio_add_page(bio, p, p_len, p_off);
+			if (res <= 0) {
+				/* A single page must always be possible!
+				 * But in case it fails anyways,
+				 * we deal with it, and complain (below). */
+				if (bio->bi_vcnt == 0) {
+					drbd_err(device,
+						"bio_add_page(%p, %p, %u, %u): %d (bi_vcnt %u bi_max_vecs %u bi_sector %llu, bi_flags 0x%lx)\n",
+						bio, p, p_len, p_off, res, bio->bi_vcnt, bio->bi_max_vecs, (uint64_t)DRBD_BIO_BI_SECTOR(bio),
+						 (unsigned long)bio->bi_flags);
+					err = -ENOSPC;
+					goto fail;
+				}
+				goto next_bio;
 			}
-			goto next_bio;
+			done += p_len;
+			data_size -= p_len;
+			sector += p_len >> 9;
+			--nr_pages;
 		}
-		data_size -= len;
-		sector += len >> 9;
-		--nr_pages;
+		done = 0;
 	}
 	D_ASSERT(device, data_size == 0);
 	D_ASSERT(device, page == NULL);
@@ -1591,7 +2028,7 @@ static void drbd_remove_peer_req_interval(struct drbd_device *device,
 {
 	struct drbd_interval *i = &peer_req->i;
 
-	drbd_remove_interval(&device->write_requests, i);
+	drbd_remove_indexed_interval(&device->write_requests, &device->write_index, i);
 	drbd_clear_interval(i);
 	peer_req->flags &= ~EE_IN_INTERVAL_TREE;
 
@@ -1751,9 +2188,9 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 		struct drbd_peer_request_details *d, struct packet_info *pi)
 {
 	struct p_trim *p = pi->data;
-	bool is_trim_or_wsame = pi->cmd == P_TRIM || pi->cmd == P_WSAME;
+	bool is_trim_or_wsame = pi->cmd == P_TRIM || pi->cmd == P_ZEROES || pi->cmd == P_WSAME;
 	unsigned int digest_size =
-		pi->cmd != P_TRIM && connection->peer_integrity_tfm ?
+		pi->cmd != P_TRIM && pi->cmd != P_ZEROES && connection->peer_integrity_tfm ?
 		crypto_ahash_digestsize(connection->peer_integrity_tfm) : 0;
 
 	d->sector = be64_to_cpu(p->p_data.sector);
@@ -1765,6 +2202,54 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 	d->digest_size = digest_size;
 }
 
+/* Instead of tr_ops->recv_pages() followed by drbd_csum_pages(), receive the
+ * payload page by page and feed each page to the integrity hash right after
+ * it arrived, while its data is still cache hot. */
+static int recv_pages_csum(struct drbd_connection *connection,
+			   struct drbd_page_chain_head *chain, size_t size, void *digest)
+{
+	struct drbd_transport *transport = &connection->transport;
+	struct crypto_ahash *tfm = connection->peer_integrity_tfm;
+	AHASH_REQUEST_ON_STACK(req, tfm);
+	struct scatterlist sg;
+	struct page *page;
+	int err = 0;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	ahash_request_set_tfm(req, tfm);
+	ahash_request_set_callback(req, 0, NULL, NULL);
+	sg_init_table(&sg, 1);
+	crypto_ahash_init(req);
+
+	page_chain_for_each(page) {
+		size_t len = min_t(size_t, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = drbd_recv_into(connection, data, len);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err)
+			break;
+		sg_set_page(&sg, page, len, 0);
+		ahash_request_set_crypt(req, &sg, NULL, len);
+		crypto_ahash_update(req);
+		size -= len;
+	}
+	if (!err) {
+		ahash_request_set_crypt(req, NULL, digest, 0);
+		crypto_ahash_final(req);
+	}
+	ahash_request_zero(req);
+
+	if (err)
+		drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
 /* used from receive_RSDataReply (recv_resync_read)
  * and from receive_Data.
  * data_size: actual payload ("data in")
@@ -1785,6 +2270,7 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	void *dig_vv = peer_device->connection->int_dig_vv;
 	struct drbd_transport *transport = &peer_device->connection->transport;
 	struct drbd_transport_ops *tr_ops = transport->ops;
+	bool have_dig_vv = false;
 
 	if (d->digest_size) {
 		err = drbd_recv_into(peer_device->connection, dig_in, d->digest_size);
@@ -1794,7 +2280,7 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 
 	if (!expect(peer_device, IS_ALIGNED(d->bi_size, 512)))
 		return NULL;
-	if (d->dp_flags & (DP_WSAME|DP_DISCARD)) {
+	if (d->dp_flags & (DP_WSAME|DP_DISCARD|DP_ZEROES)) {
 		if (!expect(peer_device, d->bi_size <= (DRBD_MAX_BBIO_SECTORS << 9)))
 			return NULL;
 	} else if (!expect(peer_device, d->bi_size <= DRBD_MAX_BIO_SIZE))
@@ -1820,7 +2306,12 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	if (d->length == 0)
 		return peer_req;
 
-	err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
+	if (d->digest_size && drbd_fused_integrity) {
+		err = recv_pages_csum(peer_device->connection, &peer_req->page_chain,
+				      d->length - d->digest_size, dig_vv);
+		have_dig_vv = true;
+	} else
+		err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
 	if (err)
 		goto fail;
 
@@ -1833,10 +2324,13 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 		data = kmap(page) + page_chain_offset(page);
 		data[0] = ~data[0];
 		kunmap(page);
+		have_dig_vv = false;
 	}
 
 	if (d->digest_size) {
-		drbd_csum_pages(peer_device->connection->peer_integrity_tfm, peer_req->page_chain.head, dig_vv);
+		if (!have_dig_vv)
+			drbd_csum_pages(peer_device->connection->peer_integrity_tfm,
+					peer_req->page_chain.head, dig_vv);
 		if (memcmp(dig_in, dig_vv, d->digest_size)) {
 			drbd_err(device, "Digest integrity check FAILED: %llus +%u\n",
 				d->sector, d->bi_size);
@@ -1931,11 +2425,13 @@ static int e_end_resync_block(struct drbd_work *w, int unused)
 	D_ASSERT(device, drbd_interval_empty(&peer_req->i));
 
 	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
-		drbd_set_in_sync(peer_device, sector, peer_req->i.size);
+		drbd_rs_set_in_sync(peer_device, sector, peer_req->i.size);
+		if (peer_device->connection->ack_batch.max)
+			return queue_batched_ack(peer_device, P_RS_WRITE_ACK, peer_req, NULL, unused);
 		err = drbd_send_ack(peer_device, P_RS_WRITE_ACK, peer_req);
 	} else {
 		/* Record failure to sync */
-		drbd_rs_failed_io(peer_device, sector, peer_req->i.size);
+		drbd_rs_set_failed(peer_device, sector, peer_req->i.size);
 
 		err  = drbd_send_ack(peer_device, P_NEG_ACK, peer_req);
 	}
@@ -2140,6 +2636,7 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 	}
 
 	atomic_add(d.bi_size >> 9, &peer_device->rs_sect_in);
+	drbd_rs_replies_received(peer_device, d.bi_size >> 9);
 
 	return err;
 }
@@ -2152,7 +2649,8 @@ static void restart_conflicting_writes(struct drbd_peer_request *peer_req)
 	const sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_for_each_indexed_overlap(i, &device->write_requests, &device->write_index,
+				      sector, size) {
 		if (!i->local)
 			continue;
 		req = container_of(i, struct drbd_request, i);
@@ -2176,6 +2674,7 @@ static int e_end_block(struct drbd_work *w, int cancel)
 	struct drbd_device *device = peer_device->device;
 	sector_t sector = peer_req->i.sector;
 	struct drbd_epoch *epoch;
+	bool batched = false;
 	int err = 0, pcmd;
 
 	if (peer_req->flags & EE_IS_BARRIER) {
@@ -2190,7 +2689,12 @@ static int e_end_block(struct drbd_work *w, int cancel)
 				peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T &&
 				peer_req->flags & EE_MAY_SET_IN_SYNC) ?
 				P_RS_WRITE_ACK : P_WRITE_ACK;
-			err = drbd_send_ack(peer_device, pcmd, peer_req);
+			if (peer_device->connection->ack_batch.max) {
+				err = queue_batched_ack(peer_device, pcmd, peer_req,
+							peer_req->epoch, cancel);
+				batched = true;
+			} else
+				err = drbd_send_ack(peer_device, pcmd, peer_req);
 			if (pcmd == P_RS_WRITE_ACK)
 				drbd_set_in_sync(peer_device, sector, peer_req->i.size);
 		} else {
@@ -2198,7 +2702,8 @@ static int e_end_block(struct drbd_work *w, int cancel)
 			/* we expect it to be marked out of sync anyways...
 			 * maybe assert this?  */
 		}
-		dec_unacked(peer_device);
+		if (!batched)
+			dec_unacked(peer_device);
 	}
 
 	/* we delete from the conflict detection hash _after_ we sent out the
@@ -2213,7 +2718,9 @@ static int e_end_block(struct drbd_work *w, int cancel)
 	} else
 		D_ASSERT(device, drbd_interval_empty(&peer_req->i));
 
-	drbd_may_finish_epoch(peer_device->connection, peer_req->epoch, EV_PUT + (cancel ? EV_CLEANUP : 0));
+	/* with a batched ack, flush_ack_batch() puts the epoch */
+	if (!batched)
+		drbd_may_finish_epoch(peer_device->connection, peer_req->epoch, EV_PUT + (cancel ? EV_CLEANUP : 0));
 
 	return err;
 }
@@ -2398,7 +2905,7 @@ static unsigned long wire_flags_to_bio_flags(struct drbd_connection *connection,
 
 static unsigned long wire_flags_to_bio_op(u32 dpf)
 {
-	if (dpf & DP_DISCARD)
+	if (dpf & (DP_ZEROES|DP_DISCARD))
 		return REQ_OP_WRITE_ZEROES;
 	if (dpf & DP_WSAME)
 		return REQ_OP_WRITE_SAME;
@@ -2414,7 +2921,8 @@ static void fail_postponed_requests(struct drbd_peer_request *peer_req)
 	const unsigned int size = peer_req->i.size;
 
     repeat:
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_for_each_indexed_overlap(i, &device->write_requests, &device->write_index,
+				      sector, size) {
 		struct drbd_request *req;
 		struct bio_and_error m;
 
@@ -2449,11 +2957,13 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 	 * Inserting the peer request into the write_requests tree will prevent
 	 * new conflicting local requests from being added.
 	 */
-	drbd_insert_interval(&device->write_requests, &peer_req->i);
+	drbd_insert_indexed_interval(&device->write_requests, &device->write_index,
+				     &peer_req->i);
 	peer_req->flags |= EE_IN_INTERVAL_TREE;
 
     repeat:
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_for_each_indexed_overlap(i, &device->write_requests, &device->write_index,
+				      sector, size) {
 		if (i == &peer_req->i)
 			continue;
 		if (i->completed)
@@ -2572,7 +3082,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 		return -EIO;
 	device = peer_device->device;
 
-	if (pi->cmd == P_TRIM)
+	if (pi->cmd == P_TRIM || pi->cmd == P_ZEROES)
 		D_ASSERT(peer_device, pi->size == 0);
 
 	p_req_detail_from_pi(connection, &d, pi);
@@ -2603,11 +3113,17 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	}
 	if (pi->cmd == P_TRIM)
 		peer_req->flags |= EE_IS_TRIM;
+	else if (pi->cmd == P_ZEROES)
+		/* Zero-out natively; without DP_DISCARD the blocks must stay
+		 * allocated, with it we may discard where that reads back zeroes. */
+		peer_req->flags |= EE_IS_TRIM |
+			(d.dp_flags & DP_DISCARD ? 0 : EE_IS_TRIM_USE_ZEROOUT | EE_ZEROOUT_NOUNMAP);
 	else if (pi->cmd == P_WSAME)
 		peer_req->flags |= EE_WRITE_SAME;
 
 	peer_req->dagtag_sector = connection->last_dagtag_sector + (peer_req->i.size >> 9);
 	connection->last_dagtag_sector = peer_req->dagtag_sector;
+	trace_drbd_peer_req_receive(peer_req);
 
 	peer_req->w.cb = e_end_block;
 	peer_req->submit_jif = jiffies;
@@ -2615,9 +3131,9 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 
 	op = wire_flags_to_bio_op(d.dp_flags);
 	op_flags = wire_flags_to_bio_flags(connection, d.dp_flags);
-	if (pi->cmd == P_TRIM) {
+	if (pi->cmd == P_TRIM || pi->cmd == P_ZEROES) {
 		D_ASSERT(peer_device, peer_req->i.size > 0);
-		D_ASSERT(peer_device, d.dp_flags & DP_DISCARD);
+		D_ASSERT(peer_device, d.dp_flags & (pi->cmd == P_ZEROES ? DP_ZEROES : DP_DISCARD));
 		D_ASSERT(peer_device, op == REQ_OP_WRITE_ZEROES);
 		D_ASSERT(peer_device, peer_req->page_chain.head == NULL);
 		D_ASSERT(peer_device, peer_req->page_chain.nr_pages == 0);
@@ -2750,6 +3266,20 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	 * Remember the op_flags. */
 	peer_req->op_flags = op_flags;
 
+	/* With peer_write_submitter, we always do. The receiver thread then
+	 * only reads from the socket, while activity log transactions and bio
+	 * submission happen in parallel on the submitter of each volume.
+	 * Epochs stay intact, as queued requests are on active_ee already.
+	 * Bio barriers (WO_BIO_BARRIER) only order against requests that
+	 * were submitted before, so in that mode we do not queue. */
+	if (drbd_peer_write_submitter &&
+	    connection->resource->write_ordering != WO_BIO_BARRIER &&
+	    connection->agreed_pro_version >= 110 &&
+	    !(peer_req->flags & (EE_IS_TRIM|EE_WRITE_SAME|EE_IS_BARRIER))) {
+		drbd_queue_peer_request(device, peer_req);
+		return 0;
+	}
+
 	/* In protocol < 110 (which is compat mode 8.4 <-> 9.0),
 	 * we must not block in the activity log here, that would
 	 * deadlock during an ongoing resync with the drbd_rs_begin_io
@@ -2847,10 +3377,51 @@ bool drbd_rs_should_slow_down(struct drbd_peer_device *peer_device, sector_t sec
 	return !drbd_sector_has_priority(peer_device, sector);
 }
 
+/* sync speed in KiB/s, average over the last 2*DRBD_SYNC_MARK_STEP, approx. */
+static unsigned long rs_recent_rate(struct drbd_peer_device *peer_device)
+{
+	unsigned long db, dt, rs_left;
+	int i;
+
+	i = (peer_device->rs_last_mark + DRBD_SYNC_MARKS-1) % DRBD_SYNC_MARKS;
+
+	if (peer_device->repl_state[NOW] == L_VERIFY_S || peer_device->repl_state[NOW] == L_VERIFY_T)
+		rs_left = peer_device->ov_left;
+	else
+		rs_left = drbd_bm_total_weight(peer_device) - peer_device->rs_failed;
+
+	dt = ((long)jiffies - (long)peer_device->rs_mark_time[i]) / HZ;
+	if (!dt)
+		dt++;
+	db = peer_device->rs_mark_left[i] - rs_left;
+	return Bit2KB(db/dt);
+}
+
+/*
+ * With resync_throttle_latency, the backing device is busy while it takes
+ * longer than that to complete application IO.  Resync keeps stepping aside
+ * until the latency is back close to the baseline, the latency seen without
+ * much resync going on.  Without application IO there is nothing to protect.
+ */
+static bool drbd_rs_latency_throttle(struct drbd_device *device, unsigned int slo)
+{
+	unsigned int lat = READ_ONCE(device->disk_lat_us);
+	unsigned int base = READ_ONCE(device->disk_lat_base_us);
+
+	if (time_after(jiffies, READ_ONCE(device->disk_lat_jif) + HZ))
+		device->rs_lat_throttled = false;
+	else if (lat > slo)
+		device->rs_lat_throttled = true;
+	else if (lat <= base + (slo - min(base, slo)) / 4)
+		device->rs_lat_throttled = false;
+
+	return device->rs_lat_throttled;
+}
+
 bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 {
 	struct drbd_device *device = peer_device->device;
-	unsigned long db, dt, dbdt;
+	unsigned int slo = drbd_resync_throttle_latency;
 	unsigned int c_min_rate;
 	int curr_events;
 
@@ -2858,6 +3429,11 @@ bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 	c_min_rate = rcu_dereference(peer_device->conf)->c_min_rate;
 	rcu_read_unlock();
 
+	/* c-min-rate stays the floor below which resync never steps aside */
+	if (slo)
+		return drbd_rs_latency_throttle(device, slo) &&
+			(c_min_rate == 0 || rs_recent_rate(peer_device) > c_min_rate);
+
 	/* feature disabled? */
 	if (c_min_rate == 0)
 		return false;
@@ -2866,27 +3442,9 @@ bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 		    - atomic_read(&device->rs_sect_ev);
 
 	if (atomic_read(&device->ap_actlog_cnt) || curr_events - peer_device->rs_last_events > 64) {
-		unsigned long rs_left;
-		int i;
-
 		peer_device->rs_last_events = curr_events;
 
-		/* sync speed average over the last 2*DRBD_SYNC_MARK_STEP,
-		 * approx. */
-		i = (peer_device->rs_last_mark + DRBD_SYNC_MARKS-1) % DRBD_SYNC_MARKS;
-
-		if (peer_device->repl_state[NOW] == L_VERIFY_S || peer_device->repl_state[NOW] == L_VERIFY_T)
-			rs_left = peer_device->ov_left;
-		else
-			rs_left = drbd_bm_total_weight(peer_device) - peer_device->rs_failed;
-
-		dt = ((long)jiffies - (long)peer_device->rs_mark_time[i]) / HZ;
-		if (!dt)
-			dt++;
-		db = peer_device->rs_mark_left[i] - rs_left;
-		dbdt = Bit2KB(db/dt);
-
-		if (dbdt > c_min_rate)
+		if (rs_recent_rate(peer_device) > c_min_rate)
 			return true;
 	}
 	return false;
@@ -2904,6 +3462,9 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 	unsigned int fault_type;
 	struct p_block_req *p =	pi->data;
 	enum drbd_disk_state min_d_state;
+	struct crypto_ahash *tfm = NULL;
+	u8 cached_digest[CSUM_CACHE_MAX_DIGEST];
+	bool cached = false;
 	int err;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
@@ -2955,11 +3516,20 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		return ignore_remaining_packet(connection, pi->size);
 	}
 
+	/* For checksum based resync, digests of ranges not written since they
+	 * were last read can be taken from the csum cache; then nothing needs
+	 * to be read.  Online verify is there to find what changed on the
+	 * media without DRBD knowing, so it always reads. */
+	if (pi->cmd == P_CSUM_RS_REQUEST)
+		tfm = connection->csums_tfm;
+	if (tfm)
+		cached = drbd_csum_cache_lookup(device, tfm, sector, size, cached_digest);
+
 	peer_req = drbd_alloc_peer_req(peer_device, GFP_TRY);
 	err = -ENOMEM;
 	if (!peer_req)
 		goto fail;
-	if (size) {
+	if (size && !cached) {
 		drbd_alloc_page_chain(&peer_device->connection->transport,
 			&peer_req->page_chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
 		if (!peer_req->page_chain.head)
@@ -3008,6 +3578,21 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		if (err)
 			goto fail2;
 
+		/* Only trust the cache if it says "equal",
+		 * read the range to confirm a difference. */
+		if (cached) {
+			if (di->digest_size == crypto_ahash_digestsize(tfm) &&
+			    !memcmp(cached_digest, di->digest, di->digest_size)) {
+				peer_req->flags |= EE_CSUM_CACHED | EE_DIGEST_DONE | EE_DIGEST_EQUAL;
+			} else {
+				err = -ENOMEM;
+				drbd_alloc_page_chain(&connection->transport, &peer_req->page_chain,
+						      DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+				if (!peer_req->page_chain.head)
+					goto fail2;
+			}
+		}
+
 		if (pi->cmd == P_CSUM_RS_REQUEST) {
 			D_ASSERT(device, connection->agreed_pro_version >= 89);
 			peer_req->w.cb = w_e_end_csum_rs_req;
@@ -3016,6 +3601,7 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		} else if (pi->cmd == P_OV_REPLY) {
 			/* track progress, we may need to throttle */
 			atomic_add(size >> 9, &peer_device->rs_sect_in);
+			drbd_rs_replies_received(peer_device, size >> 9);
 			peer_req->w.cb = w_e_end_ov_reply;
 			dec_rs_pending(peer_device);
 			/* drbd_rs_begin_io done when we sent this request,
@@ -3081,6 +3667,7 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 
 	update_receiver_timing_details(connection, drbd_rs_should_slow_down);
 	if (connection->peer_role[NOW] != R_PRIMARY &&
+	    !(peer_req->flags & EE_NOT_READ) &&
 	    drbd_rs_should_slow_down(peer_device, sector, false))
 		schedule_timeout_uninterruptible(HZ/10);
 
@@ -3101,12 +3688,26 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		}
 	}
 
+	/* Ranges a thin backing device has not allocated need not be read.
+	 * Ask only now: with the resync extent locked, no application write
+	 * can complete in between and be zeroed on the peer after it. */
+	if (peer_req->flags & EE_RS_THIN_REQ && drbd_thin_resync_query &&
+	    !drbd_range_allocated(device, sector, size))
+		peer_req->flags |= EE_RS_UNALLOCATED;
+
 submit_for_resync:
-	atomic_add(size >> 9, &device->rs_sect_ev);
+	if (!(peer_req->flags & EE_NOT_READ))
+		atomic_add(size >> 9, &device->rs_sect_ev);
 
 submit:
 	update_receiver_timing_details(connection, drbd_submit_peer_request);
 	inc_unacked(peer_device);
+	if (peer_req->flags & EE_NOT_READ) {
+		/* nothing to read, hand it to the sender as if the read completed */
+		drbd_endio_read_sec_final(peer_req);
+		return 0;
+	}
+	peer_req->csum_cache_seq = drbd_csum_cache_seq(device, sector);
 	if (drbd_submit_peer_request(device, peer_req, REQ_OP_READ, 0, fault_type) == 0)
 		return 0;
 
@@ -6318,10 +6919,19 @@ static int receive_state(struct drbd_connection *connection, struct packet_info
 
 			if (finish_now || old_peer_state.conn == L_SYNC_SOURCE ||
 			    old_peer_state.conn == L_PAUSED_SYNC_S) {
-				/* TODO: Since DRBD9 we experience that SyncSource still has
-				   bits set... NEED TO UNDERSTAND AND FIX! */
-				if (drbd_bm_total_weight(peer_device) > peer_device->rs_failed)
-					drbd_warn(peer_device, "SyncSource still sees bits set!! FIXME\n");
+				/* A SyncTarget of a multi-source resync that leaves
+				 * while other sources are still active reports
+				 * L_ESTABLISHED with its disk still D_INCONSISTENT.
+				 * It got some blocks from the other sources; we keep
+				 * those bits until it reports D_UP_TO_DATE. */
+				if (drbd_bm_total_weight(peer_device) > peer_device->rs_failed) {
+					if (peer_state.disk == D_INCONSISTENT)
+						set_bit(RS_CO_SOURCE_LEFT, &peer_device->flags);
+					else
+						/* TODO: Since DRBD9 we experience that SyncSource still has
+						   bits set... NEED TO UNDERSTAND AND FIX! */
+						drbd_warn(peer_device, "SyncSource still sees bits set!! FIXME\n");
+				}
 
 				drbd_resync_finished(peer_device, peer_state.disk);
 				peer_device->last_repl_state = peer_state.conn;
@@ -6358,6 +6968,20 @@ static int receive_state(struct drbd_connection *connection, struct packet_info
 	if (new_repl_state == L_OFF)
 		new_repl_state = L_ESTABLISHED;
 
+	/* The last source of its multi-source resync finished, the peer is
+	 * D_UP_TO_DATE now, as we are.  The bits we kept are stale. */
+	if (old_peer_state.conn == L_ESTABLISHED && peer_state.conn == L_ESTABLISHED &&
+	    peer_disk_state == D_UP_TO_DATE &&
+	    test_and_clear_bit(RS_CO_SOURCE_LEFT, &peer_device->flags) &&
+	    device->disk_state[NOW] == D_UP_TO_DATE && get_ldev(device)) {
+		drbd_info(peer_device, "Peer finished multi-source resync, clearing %lu bits\n",
+			  drbd_bm_total_weight(peer_device));
+		drbd_uuid_set_bitmap(peer_device, 0);
+		drbd_bm_clear_many_bits(peer_device, 0, -1UL);
+		drbd_md_sync_if_dirty(device);
+		put_ldev(device);
+	}
+
 	if (peer_state.conn == L_AHEAD)
 		new_repl_state = L_BEHIND;
 
@@ -6905,8 +7529,7 @@ static int receive_out_of_sync(struct drbd_connection *connection, struct packet
 		break;
 	case L_SYNC_TARGET:
 		bit = BM_SECT_TO_BIT(sector);
-		if (bit < device->bm_resync_fo)
-			device->bm_resync_fo = bit;
+		drbd_rs_rewind(peer_device, bit);
 		break;
 	default:
 #if 0
@@ -7136,6 +7759,7 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 	}
 
 	atomic_add(size >> 9, &peer_device->rs_sect_in);
+	drbd_rs_replies_received(peer_device, size >> 9);
 
 	return err;
 }
@@ -7181,6 +7805,7 @@ static struct data_cmd drbd_cmd_handler[] = {
 	[P_CURRENT_UUID]    = { 0, sizeof(struct p_current_uuid), receive_current_uuid },
 	[P_TWOPC_COMMIT]    = { 0, sizeof(struct p_twopc_request), receive_twopc },
 	[P_TRIM]	    = { 0, sizeof(struct p_trim), receive_Data },
+	[P_ZEROES]	    = { 0, sizeof(struct p_trim), receive_Data },
 	[P_RS_DEALLOCATED]  = { 0, sizeof(struct p_block_desc), receive_rs_deallocated },
 	[P_WSAME]	    = { 1, sizeof(struct p_wsame), receive_Data },
 };
@@ -7565,11 +8190,14 @@ int drbd_do_features(struct drbd_connection *connection)
 			connection->peer_node_id,
 			connection->agreed_pro_version);
 
-	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s.\n",
+	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s%s%s.\n",
 		  connection->agreed_features,
 		  connection->agreed_features & DRBD_FF_TRIM ? " TRIM" : "",
 		  connection->agreed_features & DRBD_FF_THIN_RESYNC ? " THIN_RESYNC" : "",
-		  connection->agreed_features & DRBD_FF_WSAME ? " WRITE_SAME" :
+		  connection->agreed_features & DRBD_FF_WSAME ? " WRITE_SAME" : "",
+		  connection->agreed_features & DRBD_FF_WZEROES ? " WRITE_ZEROES" : "",
+		  connection->agreed_features & DRBD_FF_OV_TREE ? " OV_TREE" : "",
+		  connection->agreed_features & DRBD_FF_ACK_BATCH ? " ACK_BATCH" :
 		  connection->agreed_features ? "" : " none");
 
 	return 1;
@@ -7997,25 +8625,60 @@ static int got_IsInSync(struct drbd_connection *connection, struct packet_info *
 
 	if (get_ldev(device)) {
 		drbd_rs_complete_io(peer_device, sector);
-		drbd_set_in_sync(peer_device, sector, blksize);
+		drbd_rs_set_in_sync(peer_device, sector, blksize);
 		/* rs_same_csums is supposed to count in units of BM_BLOCK_SIZE */
 		peer_device->rs_same_csum += (blksize >> BM_BLOCK_SHIFT);
 		put_ldev(device);
 	}
 	dec_rs_pending(peer_device);
 	atomic_add(blksize >> 9, &peer_device->rs_sect_in);
+	drbd_rs_replies_received(peer_device, blksize >> 9);
 
 	return 0;
 }
 
+/* Find the writes the sender coalesced into the P_DATA packet of req,
+ * see coalesce_writes(). They follow req in the transfer log, directly
+ * adjacent on disk, and are marked RQ_NET_COALESCED for this peer. */
+static int find_coalesced_requests(struct drbd_peer_device *peer_device,
+				   struct drbd_request *req, unsigned int size,
+				   struct drbd_request **more)
+{
+	struct drbd_resource *resource = peer_device->device->resource;
+	sector_t next_sector = req->i.sector + (req->i.size >> 9);
+	unsigned int covered = req->i.size;
+	struct drbd_request *r = req;
+	int n = 0;
+
+	list_for_each_entry_continue(r, &resource->transfer_log, tl_requests) {
+		unsigned int s;
+
+		if (covered >= size || n >= DRBD_MAX_COALESCED_REQS - 1)
+			break;
+		if (r->device != req->device || !(r->local_rq_state & RQ_WRITE))
+			continue;
+		s = drbd_req_state_by_peer_device(r, peer_device);
+		if (!(s & RQ_NET_MASK))
+			continue;
+		if (!(s & RQ_NET_COALESCED) || r->i.sector != next_sector)
+			break;
+		more[n++] = r;
+		covered += r->i.size;
+		next_sector += r->i.size >> 9;
+	}
+	return n;
+}
+
 static int
 validate_req_change_req_state(struct drbd_peer_device *peer_device, u64 id, sector_t sector,
-			      struct rb_root *root, const char *func,
+			      unsigned int size, struct rb_root *root, const char *func,
 			      enum drbd_req_event what, bool missing_ok)
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_request *req;
-	struct bio_and_error m;
+	struct drbd_request *more[DRBD_MAX_COALESCED_REQS - 1];
+	struct bio_and_error m, more_m[DRBD_MAX_COALESCED_REQS - 1];
+	int n_more = 0, i;
 
 	spin_lock_irq(&device->resource->req_lock);
 	req = find_request(device, root, id, sector, missing_ok, func);
@@ -8023,11 +8686,23 @@ validate_req_change_req_state(struct drbd_peer_device *peer_device, u64 id, sect
 		spin_unlock_irq(&device->resource->req_lock);
 		return -EIO;
 	}
+	/* One ack covering more than req: the writes coalesced into its packet */
+	if (size > req->i.size && (req->local_rq_state & RQ_WRITE))
+		n_more = find_coalesced_requests(peer_device, req, size, more);
+	trace_drbd_req_ack(req, peer_device, what);
 	__req_mod(req, what, peer_device, &m);
+	for (i = 0; i < n_more; i++) {
+		trace_drbd_req_ack(more[i], peer_device, what);
+		__req_mod(more[i], what, peer_device, &more_m[i]);
+	}
 	spin_unlock_irq(&device->resource->req_lock);
 
 	if (m.bio)
 		complete_master_bio(device, &m);
+	for (i = 0; i < n_more; i++) {
+		if (more_m[i].bio)
+			complete_master_bio(device, &more_m[i]);
+	}
 	return 0;
 }
 
@@ -8072,11 +8747,96 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 		BUG();
 	}
 
-	return validate_req_change_req_state(peer_device, p->block_id, sector,
+	return validate_req_change_req_state(peer_device, p->block_id, sector, blksize,
 					     &device->write_requests, __func__,
 					     what, false);
 }
 
+#if DRBD_FF_ACK_BATCH
+/* The acks of a P_ACK_BATCH are applied under one acquisition of the
+ * req_lock.  Acks covering writes the sender coalesced into one P_DATA
+ * are left to validate_req_change_req_state(). */
+static int got_BlockAckBatch(struct drbd_connection *connection, struct packet_info *pi)
+{
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
+	struct p_ack_batch *p = pi->data;
+	unsigned int count = be16_to_cpu(p->count);
+	struct bio_and_error m[DRBD_ACK_BATCH_MAX];
+	u32 coalesced = 0;
+	enum drbd_req_event what;
+	unsigned int i, n = 0;
+	int err = 0;
+
+	peer_device = conn_peer_device(connection, pi->vnr);
+	if (!peer_device)
+		return -EIO;
+	device = peer_device->device;
+
+	if (count > DRBD_ACK_BATCH_MAX || pi->size != sizeof(*p) + count * sizeof(p->ack[0]))
+		return -EIO;
+
+	switch (be16_to_cpu(p->cmd)) {
+	case P_RS_WRITE_ACK:
+		what = WRITE_ACKED_BY_PEER_AND_SIS;
+		break;
+	case P_WRITE_ACK:
+		what = WRITE_ACKED_BY_PEER;
+		break;
+	default:
+		return -EIO;
+	}
+
+	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
+
+	for (i = 0; i < count; i++) {
+		if (p->ack[i].block_id != ID_SYNCER)
+			continue;
+		drbd_set_in_sync(peer_device, be64_to_cpu(p->ack[i].sector),
+				 be32_to_cpu(p->ack[i].blksize));
+		dec_rs_pending(peer_device);
+	}
+
+	spin_lock_irq(&device->resource->req_lock);
+	for (i = 0; i < count; i++) {
+		struct p_ack_batch_entry *a = &p->ack[i];
+		struct drbd_request *req;
+
+		if (a->block_id == ID_SYNCER)
+			continue;
+		req = find_request(device, &device->write_requests, a->block_id,
+				   be64_to_cpu(a->sector), false, __func__);
+		if (unlikely(!req)) {
+			err = -EIO;
+			break;
+		}
+		if (be32_to_cpu(a->blksize) > req->i.size) {
+			coalesced |= 1U << i;
+			continue;
+		}
+		trace_drbd_req_ack(req, peer_device, what);
+		__req_mod(req, what, peer_device, &m[n++]);
+	}
+	spin_unlock_irq(&device->resource->req_lock);
+
+	for (i = 0; i < n; i++) {
+		if (m[i].bio)
+			complete_master_bio(device, &m[i]);
+	}
+
+	for (i = 0; i < count && !err; i++) {
+		if (!(coalesced & (1U << i)))
+			continue;
+		err = validate_req_change_req_state(peer_device, p->ack[i].block_id,
+						    be64_to_cpu(p->ack[i].sector),
+						    be32_to_cpu(p->ack[i].blksize),
+						    &device->write_requests, __func__,
+						    what, false);
+	}
+	return err;
+}
+#endif
+
 static int got_NegAck(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_device *peer_device;
@@ -8102,7 +8862,7 @@ static int got_NegAck(struct drbd_connection *connection, struct packet_info *pi
 		return 0;
 	}
 
-	err = validate_req_change_req_state(peer_device, p->block_id, sector,
+	err = validate_req_change_req_state(peer_device, p->block_id, sector, size,
 					    &device->write_requests, __func__,
 					    NEG_ACKED, true);
 	if (err) {
@@ -8134,6 +8894,7 @@ static int got_NegDReply(struct drbd_connection *connection, struct packet_info
 		 (unsigned long long)sector, be32_to_cpu(p->blksize));
 
 	return validate_req_change_req_state(peer_device, p->block_id, sector,
+					     be32_to_cpu(p->blksize),
 					     &device->read_requests, __func__,
 					     NEG_ACKED, false);
 }
@@ -8163,15 +8924,16 @@ static int got_NegRSDReply(struct drbd_connection *connection, struct packet_inf
 		drbd_rs_complete_io(peer_device, sector);
 		switch (pi->cmd) {
 		case P_NEG_RS_DREPLY:
-			drbd_rs_failed_io(peer_device, sector, size);
+			drbd_rs_set_failed(peer_device, sector, size);
 			break;
 		case P_RS_CANCEL:
 			bit = BM_SECT_TO_BIT(sector);
 			mutex_lock(&device->bm_resync_fo_mutex);
-			device->bm_resync_fo = min(device->bm_resync_fo, bit);
+			drbd_rs_rewind(peer_device, bit);
 			mutex_unlock(&device->bm_resync_fo_mutex);
 
 			atomic_add(size >> 9, &peer_device->rs_sect_in);
+			drbd_rs_replies_received(peer_device, size >> 9);
 			mod_timer(&peer_device->resync_timer, jiffies + SLEEP_TIME);
 			break;
 		default:
@@ -8213,6 +8975,7 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 	struct drbd_device *device;
 	struct p_block_ack *p = pi->data;
 	sector_t sector;
+	u64 block_id;
 	int size;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
@@ -8222,12 +8985,13 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 
 	sector = be64_to_cpu(p->sector);
 	size = be32_to_cpu(p->blksize);
+	block_id = be64_to_cpu(p->block_id);
 
 	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
 
-	if (be64_to_cpu(p->block_id) == ID_OUT_OF_SYNC)
+	if (block_id == ID_OUT_OF_SYNC)
 		drbd_ov_out_of_sync_found(peer_device, sector, size);
-	else
+	else if (block_id == ID_IN_SYNC)
 		ov_out_of_sync_print(peer_device);
 
 	if (!get_ldev(device))
@@ -8236,7 +9000,9 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 	drbd_rs_complete_io(peer_device, sector);
 	dec_rs_pending(peer_device);
 
-	--peer_device->ov_left;
+	/* ID_OV_DESCEND: the peer asks again for the parts of this range */
+	if (block_id != ID_OV_DESCEND)
+		drbd_ov_done(peer_device, size);
 
 	/* let's advance progress step marks only for every other megabyte */
 	if ((peer_device->ov_left & 0x200) == 0x200)
@@ -8510,6 +9276,9 @@ static struct meta_sock_cmd ack_receiver_tbl[] = {
 	[P_RETRY_WRITE]	    = { sizeof(struct p_block_ack), got_BlockAck },
 	[P_PEER_ACK]	    = { sizeof(struct p_peer_ack), got_peer_ack },
 	[P_PEERS_IN_SYNC]   = { sizeof(struct p_peer_block_desc), got_peers_in_sync },
+#if DRBD_FF_ACK_BATCH
+	[P_ACK_BATCH]       = { sizeof(struct p_ack_batch), got_BlockAckBatch },
+#endif
 	[P_TWOPC_YES]       = { sizeof(struct p_twopc_reply), got_twopc_reply },
 	[P_TWOPC_NO]        = { sizeof(struct p_twopc_reply), got_twopc_reply },
 	[P_TWOPC_RETRY]     = { sizeof(struct p_twopc_reply), got_twopc_reply },
@@ -8617,6 +9386,13 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 				goto disconnect;
 			}
 			expect = header_size + cmd->pkt_size;
+#if DRBD_FF_ACK_BATCH
+			/* the only one with a variable number of entries */
+			if (pi.cmd == P_ACK_BATCH && pi.size > cmd->pkt_size &&
+			    pi.size <= cmd->pkt_size +
+			    DRBD_ACK_BATCH_MAX * sizeof(struct p_ack_batch_entry))
+				expect = header_size + pi.size;
+#endif
 			if (pi.size != expect - header_size) {
 				drbd_err(connection, "Wrong packet size on meta (c: %d, l: %d)\n",
 					pi.cmd, pi.size);
@@ -8667,6 +9443,7 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	struct drbd_connection *connection =
 		container_of(ws, struct drbd_connection, send_acks_work);
 	struct drbd_transport *transport = &connection->transport;
+	unsigned int delay = drbd_ack_batch_delay;
 	struct net_conf *nc;
 	int tcp_cork, err;
 
@@ -8675,6 +9452,11 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	tcp_cork = nc->tcp_cork;
 	rcu_read_unlock();
 
+	/* give more writes the chance to complete and share the P_ACK_BATCH */
+	if (delay && ack_batch_max(connection) &&
+	    atomic_read(&connection->done_ee_cnt) < ack_batch_max(connection))
+		usleep_range(delay, 2 * delay);
+
 	/* TODO: conditionally cork; it may hurt latency if we cork without
 	   much to send */
 	if (tcp_cork)
@@ -29,6 +29,7 @@
 #include <linux/drbd.h>
 #include "drbd_int.h"
 #include "drbd_req.h"
+#include "drbd_trace.h"
 
 
 
@@ -116,6 +117,7 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 	              | (bio_op(bio_src) == REQ_OP_WRITE_ZEROES ? RQ_UNMAP : 0)
 	              | (bio_op(bio_src) == REQ_OP_DISCARD ? RQ_UNMAP : 0);
 
+	trace_drbd_req_new(req);
 	return req;
 }
 
@@ -140,6 +142,7 @@ void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *re
 			continue;
 		kref_get(&req->kref);
 		req->net_rq_state[node_id] |= RQ_PEER_ACK;
+		resource->peer_ack_ctl.period_acks++;
 		if (!queued) {
 			list_add_tail(&req->tl_requests, &resource->peer_ack_list);
 			queued = true;
@@ -163,28 +166,161 @@ static bool peer_ack_differs(struct drbd_request *req1, struct drbd_request *req
 	return false;
 }
 
+#define PEER_ACK_CTL_PERIOD	(HZ/10)
+#define PEER_ACK_WINDOW_MAX	(1U << 24) /* 8 GiB worth of sectors */
+
+/* Adapt the peer ack window to the observed write rate and to the number of
+ * peers every P_PEER_ACK has to be sent to, so that we stay below
+ * drbd_peer_ack_max_rate packets per second, and bound the time a completed
+ * write may wait for its peer ack by drbd_peer_ack_max_delay.
+ * The static res_opts.peer_ack_window is the lower bound of the window,
+ * res_opts.peer_ack_delay the upper bound of the delay.
+ *
+ * Called with resource->req_lock held. */
+static void peer_ack_adapt(struct drbd_resource *resource)
+{
+	struct peer_ack_ctl *ctl = &resource->peer_ack_ctl;
+	unsigned int max_rate = drbd_peer_ack_max_rate;
+	unsigned int max_delay = drbd_peer_ack_max_delay;
+	unsigned long now = jiffies;
+	unsigned long dt = now - ctl->period_start_jif;
+	struct drbd_connection *connection;
+	unsigned long delay, min_interval;
+	unsigned int peers = 0;
+	u64 window;
+
+	if (dt < PEER_ACK_CTL_PERIOD && ctl->window)
+		return;
+
+	for_each_connection(connection, resource) {
+		if (connection->agreed_pro_version >= 110 &&
+		    connection->cstate[NOW] == C_CONNECTED)
+			peers++;
+	}
+
+	if (dt) {
+		u64 sectors = resource->dagtag_sector - ctl->period_start_dagtag;
+
+		ctl->sect_per_sec = div_u64(sectors * HZ, dt);
+		ctl->acks_per_sec = ctl->period_acks * HZ / dt;
+	}
+	ctl->peers = peers;
+	ctl->period_start_jif = now;
+	ctl->period_start_dagtag = resource->dagtag_sector;
+	ctl->period_acks = 0;
+
+	window = resource->res_opts.peer_ack_window;
+	delay = resource->res_opts.peer_ack_delay * HZ / 1000;
+	if (max_rate && peers) {
+		/* Every P_PEER_ACK is one packet on each peer's control stream.
+		 * Size the window so that at the current write rate we do not
+		 * exceed max_rate packets per second... */
+		window = max(window, div_u64(ctl->sect_per_sec * peers, max_rate));
+
+		/* ...and never wait longer than necessary to honor max_rate
+		 * when writes are sparse, so the bitmap gets cleaned up early. */
+		min_interval = DIV_ROUND_UP(peers * HZ, max_rate);
+		delay = min(delay, max(min_interval, 1UL));
+	}
+	if (max_delay)
+		delay = min(delay, msecs_to_jiffies(max_delay));
+
+	ctl->window = min_t(u64, window, PEER_ACK_WINDOW_MAX);
+	ctl->delay = max(delay, 1UL);
+}
+
 static bool peer_ack_window_full(struct drbd_request *req)
 {
 	struct drbd_resource *resource = req->device->resource;
-	u32 peer_ack_window = resource->res_opts.peer_ack_window;
+	u32 peer_ack_window = resource->peer_ack_ctl.window;
 	u64 last_dagtag = resource->last_peer_acked_dagtag + peer_ack_window;
 
 	return dagtag_newer_eq(req->dagtag_sector, last_dagtag);
 }
 
+/* A completed write must not wait longer than the configured peer-ack-delay,
+ * nor longer than drbd_peer_ack_max_delay, even if further completions keep
+ * pushing the timer out. */
+static unsigned long peer_ack_max_wait(struct drbd_resource *resource)
+{
+	unsigned int max_delay = drbd_peer_ack_max_delay;
+	unsigned long wait = msecs_to_jiffies(resource->res_opts.peer_ack_delay);
+
+	if (max_delay)
+		wait = min(wait, msecs_to_jiffies(max_delay));
+	return max(wait, 1UL);
+}
+
+static bool peer_ack_too_old(struct drbd_resource *resource)
+{
+	return time_after_eq(jiffies, resource->peer_ack_ctl.first_pending_jif +
+			     peer_ack_max_wait(resource));
+}
+
+static unsigned long peer_ack_expires(struct drbd_resource *resource)
+{
+	struct peer_ack_ctl *ctl = &resource->peer_ack_ctl;
+	unsigned long expires = jiffies + ctl->delay;
+	unsigned long deadline = ctl->first_pending_jif + peer_ack_max_wait(resource);
+
+	if (time_before(deadline, expires))
+		expires = deadline;
+	return expires;
+}
+
 static void drbd_remove_request_interval(struct rb_root *root,
+					 struct drbd_interval_index *index,
 					 struct drbd_request *req)
 {
 	struct drbd_device *device = req->device;
 	struct drbd_interval *i = &req->i;
 
-	drbd_remove_interval(root, i);
+	drbd_remove_indexed_interval(root, index, i);
 
 	/* Wake up any processes waiting for this request to complete.  */
 	if (i->waiting)
 		wake_up(&device->misc_wait);
 }
 
+/* Account the time between two request time stamps, if both have been set */
+static void lat_hist_add(struct drbd_lat_hist *h, ktime_t from, ktime_t to)
+{
+	s64 us;
+
+	if (!ktime_to_ns(from) || !ktime_to_ns(to))
+		return;
+	us = max_t(s64, ktime_us_delta(to, from), 0);
+	h->count[drbd_lat_hist_bucket(us)]++;
+	h->sum_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+}
+
+/* Latency of the backing device for application IO, for
+ * resync_throttle_latency.  Called with req_lock held. */
+static void drbd_disk_lat_sample(struct drbd_device *device, struct drbd_request *req)
+{
+	unsigned int us = ktime_us_delta(req->local_done_kt, req->pre_submit_kt);
+	unsigned int lat, base;
+
+	/* EWMA, weight 1/8; the first sample seeds average and baseline */
+	if (!device->disk_lat_us) {
+		lat = us;
+		base = us;
+	} else {
+		lat = device->disk_lat_us - (device->disk_lat_us >> 3) + (us >> 3);
+		base = device->disk_lat_base_us;
+		if (lat < base || !base)
+			base = lat;
+		else
+			base += (lat - base) >> 8;
+	}
+
+	WRITE_ONCE(device->disk_lat_us, lat);
+	WRITE_ONCE(device->disk_lat_base_us, base);
+	WRITE_ONCE(device->disk_lat_jif, jiffies);
+}
+
 /* must_hold resource->req_lock */
 void drbd_req_destroy(struct kref *kref)
 {
@@ -207,6 +343,15 @@ void drbd_req_destroy(struct kref *kref)
 		device->reqs++;
 		ktime_aggregate(device, req, in_actlog_kt);
 		ktime_aggregate(device, req, pre_submit_kt);
+		lat_hist_add(&device->lat_al, req->start_kt, req->in_actlog_kt);
+		lat_hist_add(&device->lat_local, req->pre_submit_kt, req->local_done_kt);
+		lat_hist_add(&device->lat_total, req->start_kt, req->completed_kt);
+		if (ktime_to_ns(req->completed_kt)) {
+			unsigned int us = ktime_us_delta(req->completed_kt, req->start_kt);
+			/* EWMA, weight 1/8 */
+			device->write_lat_us = device->write_lat_us - (device->write_lat_us >> 3) + (us >> 3);
+			device->write_lat_kt = req->completed_kt;
+		}
 		for_each_peer_device(peer_device, device) {
 			int node_id = peer_device->node_id;
 			unsigned ns = drbd_req_state_by_peer_device(req, peer_device);
@@ -215,6 +360,14 @@ void drbd_req_destroy(struct kref *kref)
 			ktime_aggregate_pd(peer_device, node_id, req, pre_send_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, acked_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, net_done_kt);
+			/* queued for the network once in the activity log, if diskless right away */
+			lat_hist_add(&peer_device->lat_send_queue,
+				     ktime_to_ns(req->in_actlog_kt) ? req->in_actlog_kt : req->start_kt,
+				     req->pre_send_kt[node_id]);
+			lat_hist_add(&peer_device->lat_peer_ack,
+				     req->pre_send_kt[node_id], req->acked_kt[node_id]);
+			lat_hist_add(&peer_device->lat_barrier_ack,
+				     req->acked_kt[node_id], req->net_done_kt[node_id]);
 		}
 		spin_unlock_irqrestore(&device->timing_lock, flags);
 	}
@@ -246,13 +399,15 @@ void drbd_req_destroy(struct kref *kref)
 	/* finally remove the request from the conflict detection
 	 * respective block_id verification interval tree. */
 	if (!drbd_interval_empty(&req->i)) {
+		struct drbd_interval_index *index = NULL;
 		struct rb_root *root;
 
-		if (s & RQ_WRITE)
+		if (s & RQ_WRITE) {
 			root = &device->write_requests;
-		else
+			index = &device->write_index;
+		} else
 			root = &device->read_requests;
-		drbd_remove_request_interval(root, req);
+		drbd_remove_request_interval(root, index, req);
 	} else if (s & (RQ_NET_MASK & ~RQ_NET_DONE) && req->i.size != 0)
 		drbd_err(device, "drbd_req_destroy: Logic BUG: interval empty, but: rq_state=0x%x, sect=%llu, size=%u\n",
 			s, (unsigned long long)req->i.sector, req->i.size);
@@ -317,10 +472,12 @@ void drbd_req_destroy(struct kref *kref)
 		struct drbd_resource *resource = device->resource;
 		struct drbd_request *peer_ack_req = resource->peer_ack_req;
 
+		peer_ack_adapt(resource);
 		if (peer_ack_req) {
 			if (peer_ack_differs(req, peer_ack_req) ||
 			    (was_last_ref && atomic_read(&device->ap_actlog_cnt)) ||
-			    peer_ack_window_full(req)) {
+			    peer_ack_window_full(req) ||
+			    peer_ack_too_old(resource)) {
 				drbd_queue_peer_ack(resource, peer_ack_req);
 				peer_ack_req = NULL;
 			} else
@@ -328,8 +485,9 @@ void drbd_req_destroy(struct kref *kref)
 		}
 		req->device = NULL;
 		resource->peer_ack_req = req;
-		mod_timer(&resource->peer_ack_timer,
-			  jiffies + resource->res_opts.peer_ack_delay * HZ / 1000);
+		if (!peer_ack_req)
+			resource->peer_ack_ctl.first_pending_jif = jiffies;
+		mod_timer(&resource->peer_ack_timer, peer_ack_expires(resource));
 
 		if (!peer_ack_req)
 			resource->last_peer_acked_dagtag = req->dagtag_sector;
@@ -500,6 +658,7 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 		m->error = ok && quorum ? 0 : (error ?: -EIO);
 		m->bio = req->master_bio;
 		req->master_bio = NULL;
+		req->completed_kt = ktime_get();
 		/* We leave it in the tree, to be able to verify later
 		 * write-acks in protocol != C during resync.
 		 * But we mark it as "complete", so it won't be counted as
@@ -666,6 +825,8 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	    (idx == -1 || req->net_rq_state[idx] == old_net))
 		return;
 
+	trace_drbd_req_state(req, idx, old_local, old_net);
+
 	/* intent: get references */
 
 	kref_get(&req->kref);
@@ -710,6 +871,9 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	}
 
 	if ((old_local & RQ_LOCAL_PENDING) && (clear_local & RQ_LOCAL_PENDING)) {
+		req->local_done_kt = ktime_get();
+		if (drbd_resync_throttle_latency)
+			drbd_disk_lat_sample(req->device, req);
 		if (req->local_rq_state & RQ_LOCAL_ABORTED)
 			kref_put(&req->kref, drbd_req_destroy);
 		else
@@ -1080,7 +1244,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		   allowed to complete this one "out-of-sequence".
 		 */
 		if (!(req->net_rq_state[idx] & RQ_NET_OK)) {
-			mod_rq_state(req, m, peer_device, RQ_COMPLETION_SUSP,
+			mod_rq_state(req, m, peer_device, RQ_COMPLETION_SUSP|RQ_NET_COALESCED,
 					RQ_NET_QUEUED|RQ_NET_PENDING);
 			break;
 		}
@@ -1213,7 +1377,8 @@ static void complete_conflicting_writes(struct drbd_request *req)
 	int size = req->i.size;
 
 	for (;;) {
-		drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+		drbd_for_each_indexed_overlap(i, &device->write_requests,
+					      &device->write_index, sector, size) {
 			/* Ignore, if already completed to upper layers. */
 			if (i->completed)
 				continue;
@@ -1432,7 +1597,8 @@ static int drbd_process_write_request(struct drbd_request *req)
 			if (!in_tree) {
 				/* Corresponding drbd_remove_request_interval is in
 				 * drbd_req_complete() */
-				drbd_insert_interval(&device->write_requests, &req->i);
+				drbd_insert_indexed_interval(&device->write_requests,
+							     &device->write_index, &req->i);
 				in_tree = true;
 			}
 			_req_mod(req, QUEUE_FOR_NET_WRITE, peer_device);
@@ -1445,8 +1611,10 @@ static int drbd_process_write_request(struct drbd_request *req)
 
 static void drbd_process_discard_req(struct drbd_request *req)
 {
+	bool may_unmap = drbd_bio_may_unmap(req->private_bio);
 	int err = drbd_issue_discard_or_zero_out(req->device,
-				req->i.sector, req->i.size >> 9, true);
+				req->i.sector, req->i.size >> 9,
+				may_unmap, !may_unmap);
 	drbd_bio_endio(req->private_bio, err ? BLK_STS_IOERR : BLK_STS_OK);
 }
 
@@ -1477,8 +1645,11 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 		else if (bio_op(bio) == REQ_OP_WRITE_ZEROES ||
 			 bio_op(bio) == REQ_OP_DISCARD)
 			drbd_process_discard_req(req);
-		else
+		else {
+			if (bio_op(bio) != REQ_OP_READ)
+				drbd_zeroed_forget(device->ldev, req->i.sector, req->i.size >> 9);
 			generic_make_request(bio);
+		}
 		put_ldev(device);
 	} else
 		drbd_bio_endio(bio, BLK_STS_IOERR);
@@ -1528,6 +1699,9 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio, ktime_t start_
 	/* Update disk stats */
 	_drbd_start_io_acct(device, req);
 
+	if (drbd_resync_by_heat && req->i.size)
+		drbd_heat_account(device, req->i.sector);
+
 	/* process discards always from our submitter thread */
 	if ((bio_op(bio) == REQ_OP_WRITE_ZEROES) ||
 	    (bio_op(bio) == REQ_OP_DISCARD))
@@ -202,6 +202,10 @@ enum drbd_req_state_bits {
 	/* p_peer_ack packet needs to be sent */
 	__RQ_PEER_ACK,
 
+	/* sent as part of the P_DATA packet of a preceding request,
+	 * acknowledged together with that one */
+	__RQ_NET_COALESCED,
+
 	/* 4321
 	 * 0000: no local possible
 	 * 0001: to be submitted
@@ -251,6 +255,7 @@ enum drbd_req_state_bits {
 #define RQ_EXP_BARR_ACK    (1UL << __RQ_EXP_BARR_ACK)
 
 #define RQ_PEER_ACK	   (1UL << __RQ_PEER_ACK)
+#define RQ_NET_COALESCED   (1UL << __RQ_NET_COALESCED)
 
 #define RQ_LOCAL_PENDING   (1UL << __RQ_LOCAL_PENDING)
 #define RQ_LOCAL_COMPLETED (1UL << __RQ_LOCAL_COMPLETED)
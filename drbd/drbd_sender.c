@@ -38,13 +38,15 @@
 #include "drbd_int.h"
 #include "drbd_protocol.h"
 #include "drbd_req.h"
+#include "drbd_trace.h"
 
 void drbd_panic_after_delayed_completion_of_aborted_request(struct drbd_device *device);
 
-static int make_ov_request(struct drbd_peer_device *, int);
-static int make_resync_request(struct drbd_peer_device *, int);
+static int make_ov_request(struct drbd_peer_device *, int, bool);
+static int make_resync_request(struct drbd_peer_device *, int, bool);
 static bool should_send_barrier(struct drbd_connection *, unsigned int epoch);
 static void maybe_send_barrier(struct drbd_connection *, unsigned int);
+static int w_e_send_csum(struct drbd_work *, int);
 
 /* endio handlers:
  *   drbd_md_endio (defined here)
@@ -94,10 +96,7 @@ void drbd_md_endio BIO_ENDIO_ARGS(struct bio *bio)
 	wake_up(&device->misc_wait);
 }
 
-/* reads on behalf of the partner,
- * "submitted" by the receiver
- */
-static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __releases(local)
+static void read_sec_done(struct drbd_peer_request *peer_req) __releases(local)
 {
 	unsigned long flags = 0;
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
@@ -105,7 +104,8 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	struct drbd_connection *connection = peer_device->connection;
 
 	spin_lock_irqsave(&device->resource->req_lock, flags);
-	device->read_cnt += peer_req->i.size >> 9;
+	if (!(peer_req->flags & EE_NOT_READ))
+		device->read_cnt += peer_req->i.size >> 9;
 	list_del(&peer_req->w.list);
 	if (list_empty(&connection->read_ee))
 		wake_up(&connection->ee_wait);
@@ -117,6 +117,142 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	put_ldev(device);
 }
 
+/* Resync and verify digests, see digest_peer_req() */
+static struct workqueue_struct *drbd_digest_wq;
+
+struct digest_queue {
+	spinlock_t lock;
+	struct list_head list;
+	struct work_struct work;
+};
+static DEFINE_PER_CPU(struct digest_queue, digest_queues);
+
+static struct crypto_ahash *digest_tfm(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+
+	if (peer_req->w.cb == w_e_end_ov_req || peer_req->w.cb == w_e_end_ov_reply)
+		return connection->verify_tfm;
+	if (peer_req->w.cb == w_e_send_csum || peer_req->w.cb == w_e_end_csum_rs_req)
+		return connection->csums_tfm;
+	return NULL;
+}
+
+/* Do the hashing part of w_e_send_csum(), w_e_end_csum_rs_req(),
+ * w_e_end_ov_req() and w_e_end_ov_reply() ahead of time.  If anything
+ * goes wrong here, EE_DIGEST_DONE stays clear and the sender does it. */
+static void digest_peer_req(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	struct crypto_ahash *tfm = digest_tfm(peer_req);
+	u8 digest[CSUM_CACHE_MAX_DIGEST];
+	struct digest_info *di;
+	int digest_size;
+
+	if (!tfm)
+		return;
+	digest_size = crypto_ahash_digestsize(tfm);
+	if (digest_size > sizeof(digest))
+		return;
+
+	drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+	drbd_csum_cache_insert(device, tfm, peer_req->i.sector, peer_req->i.size,
+			       peer_req->csum_cache_seq, digest);
+
+	if (peer_req->flags & EE_HAS_DIGEST) {
+		di = peer_req->digest;
+		if (di->digest_size == digest_size && !memcmp(digest, di->digest, digest_size))
+			peer_req->flags |= EE_DIGEST_EQUAL;
+	} else {
+		di = kmalloc(sizeof(*di) + digest_size, GFP_NOIO);
+		if (!di)
+			return;
+		di->digest_size = digest_size;
+		di->digest = ((char *)di) + sizeof(*di);
+		memcpy(di->digest, digest, digest_size);
+		/* block_id is not used any more once the read completed */
+		peer_req->digest = di;
+		peer_req->flags |= EE_HAS_DIGEST;
+	}
+	peer_req->flags |= EE_DIGEST_DONE;
+}
+
+static void digest_work_fn(struct work_struct *work)
+{
+	struct digest_queue *q = container_of(work, struct digest_queue, work);
+	struct drbd_peer_request *peer_req, *tmp;
+	LIST_HEAD(batch);
+
+	spin_lock_irq(&q->lock);
+	list_splice_init(&q->list, &batch);
+	spin_unlock_irq(&q->lock);
+
+	list_for_each_entry_safe(peer_req, tmp, &batch, recv_order) {
+		list_del_init(&peer_req->recv_order);
+		digest_peer_req(peer_req);
+		read_sec_done(peer_req);
+	}
+}
+
+/* The peer request stays on read_ee, so drain_resync_activity() waits for it.
+ * Reads do not use recv_order otherwise. */
+static void queue_digest(struct drbd_peer_request *peer_req)
+{
+	struct digest_queue *q;
+	unsigned long flags;
+	bool kick;
+
+	q = get_cpu_ptr(&digest_queues);
+	spin_lock_irqsave(&q->lock, flags);
+	kick = list_empty(&q->list);
+	list_add_tail(&peer_req->recv_order, &q->list);
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (kick)
+		queue_work_on(smp_processor_id(), drbd_digest_wq, &q->work);
+	put_cpu_ptr(&digest_queues);
+}
+
+int drbd_digest_init(void)
+{
+	int cpu;
+
+	drbd_digest_wq = alloc_workqueue("drbd_digest", WQ_MEM_RECLAIM | WQ_CPU_INTENSIVE, 0);
+	if (!drbd_digest_wq)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct digest_queue *q = per_cpu_ptr(&digest_queues, cpu);
+
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->list);
+		INIT_WORK(&q->work, digest_work_fn);
+	}
+	return 0;
+}
+
+void drbd_digest_cleanup(void)
+{
+	if (drbd_digest_wq)
+		destroy_workqueue(drbd_digest_wq);
+}
+
+/* reads on behalf of the partner,
+ * "submitted" by the receiver,
+ * or answered without reading, see EE_NOT_READ
+ */
+void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __releases(local)
+{
+	/* With digest_offload, reads for checksum based resync and verify
+	 * are hashed on this CPU before they are queued for the sender. */
+	if (drbd_digest_offload &&
+	    !(peer_req->flags & (EE_WAS_ERROR | EE_DIGEST_DONE)) &&
+	    digest_tfm(peer_req)) {
+		queue_digest(peer_req);
+		return;
+	}
+	read_sec_done(peer_req);
+}
+
 static int is_failed_barrier(int ee_flags)
 {
 	return (ee_flags & (EE_IS_BARRIER|EE_WAS_ERROR|EE_RESUBMITTED|EE_IS_TRIM))
@@ -135,6 +271,8 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 	int do_wake;
 	u64 block_id;
 
+	trace_drbd_peer_req_done(peer_req);
+
 	/* if this is a failed barrier request, disable use of barriers,
 	 * and schedule for resubmission */
 	if (is_failed_barrier(peer_req->flags)) {
@@ -150,6 +288,10 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 		return;
 	}
 
+	drbd_csum_cache_invalidate(device, peer_req->i.sector, peer_req->i.size);
+	/* before it leaves active_ee, see drbd_flush_request() */
+	atomic_inc(&device->flush.writes);
+
 	/* after we moved peer_req to done_ee,
 	 * we may no longer access it,
 	 * it may be freed/reused already!
@@ -157,6 +299,9 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 	sector = peer_req->i.sector;
 	block_id = peer_req->block_id;
 
+	if (block_id == ID_SYNCER)
+		drbd_rs_model_disk_sample(peer_device, jiffies - peer_req->submit_jif);
+
 	if (peer_req->flags & EE_WAS_ERROR) {
                 /* In protocol != C, we usually do not send write acks.
                  * In case of a write error, send the neg ack anyways. */
@@ -311,6 +456,9 @@ void drbd_request_endio BIO_ENDIO_ARGS(struct bio *bio)
 		what = COMPLETED_OK;
 	}
 
+	if (bio_op(bio) != REQ_OP_READ)
+		drbd_csum_cache_invalidate(device, req->i.sector, req->i.size);
+
 	bio_put(req->private_bio);
 	req->private_bio = ERR_PTR(blk_status_to_errno(status));
 
@@ -379,6 +527,7 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 {
 	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct crypto_ahash *tfm = peer_device->connection->csums_tfm;
 	int digest_size;
 	void *digest;
 	int err = 0;
@@ -389,10 +538,16 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 	if (unlikely((peer_req->flags & EE_WAS_ERROR) != 0))
 		goto out;
 
-	digest_size = crypto_ahash_digestsize(peer_device->connection->csums_tfm);
+	digest_size = crypto_ahash_digestsize(tfm);
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (digest) {
-		drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+		if (peer_req->flags & EE_DIGEST_DONE) {
+			memcpy(digest, peer_req->digest->digest, digest_size);
+		} else {
+			drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+			drbd_csum_cache_insert(peer_device->device, tfm, peer_req->i.sector,
+					       peer_req->i.size, peer_req->csum_cache_seq, digest);
+		}
 		/* Free peer_req and pages before send.
 		 * In case we block on congestion, we could otherwise run into
 		 * some distributed deadlock, if the other side blocks on
@@ -419,15 +574,41 @@ out:
 static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector, int size)
 {
 	struct drbd_device *device = peer_device->device;
+	struct crypto_ahash *tfm = peer_device->connection->csums_tfm;
 	struct drbd_peer_request *peer_req;
+	u8 cached_digest[CSUM_CACHE_MAX_DIGEST];
+	bool cached;
 
 	if (!get_ldev(device))
 		return -EIO;
 
+	cached = drbd_csum_cache_lookup(device, tfm, sector, size, cached_digest);
+
 	/* Do not wait if no memory is immediately available.  */
 	peer_req = drbd_alloc_peer_req(peer_device, GFP_TRY & ~__GFP_RECLAIM);
 	if (!peer_req)
 		goto defer;
+	if (cached) {
+		struct digest_info *di;
+		int digest_size = crypto_ahash_digestsize(tfm);
+
+		di = kmalloc(sizeof(*di) + digest_size, GFP_NOIO);
+		if (!di)
+			goto defer2;
+		di->digest_size = digest_size;
+		di->digest = ((char *)di) + sizeof(*di);
+		memcpy(di->digest, cached_digest, digest_size);
+
+		peer_req->i.size = size;
+		peer_req->i.sector = sector;
+		peer_req->digest = di;
+		peer_req->flags |= EE_HAS_DIGEST | EE_CSUM_CACHED | EE_DIGEST_DONE;
+		peer_req->w.cb = w_e_send_csum;
+		/* nothing to read, send from the sender thread right away */
+		drbd_queue_work(&peer_device->connection->sender_work, &peer_req->w);
+		put_ldev(device);
+		return 0;
+	}
 	if (size) {
 		drbd_alloc_page_chain(&peer_device->connection->transport,
 			&peer_req->page_chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
@@ -444,6 +625,7 @@ static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector,
 	spin_unlock_irq(&device->resource->req_lock);
 
 	atomic_add(size >> 9, &device->rs_sect_ev);
+	peer_req->csum_cache_seq = drbd_csum_cache_seq(device, sector);
 	if (drbd_submit_peer_request(device, peer_req, REQ_OP_READ, 0, DRBD_FAULT_RS_RD) == 0)
 		return 0;
 
@@ -462,25 +644,40 @@ defer:
 	return -EAGAIN;
 }
 
-int w_resync_timer(struct drbd_work *w, int cancel)
+static void make_resync_or_ov_requests(struct drbd_peer_device *peer_device, int cancel, bool refill)
 {
-	struct drbd_peer_device *peer_device =
-		container_of(w, struct drbd_peer_device, resync_work);
 	struct drbd_device *device = peer_device->device;
 
 	mutex_lock(&device->bm_resync_fo_mutex);
 	switch (peer_device->repl_state[NOW]) {
 	case L_VERIFY_S:
-		make_ov_request(peer_device, cancel);
+		make_ov_request(peer_device, cancel, refill);
 		break;
 	case L_SYNC_TARGET:
-		make_resync_request(peer_device, cancel);
+		make_resync_request(peer_device, cancel, refill);
 		break;
 	default:
 		break;
 	}
 	mutex_unlock(&device->bm_resync_fo_mutex);
+}
 
+int w_resync_timer(struct drbd_work *w, int cancel)
+{
+	struct drbd_peer_device *peer_device =
+		container_of(w, struct drbd_peer_device, resync_work);
+
+	make_resync_or_ov_requests(peer_device, cancel, false);
+	return 0;
+}
+
+/* Replies came in, replace them with new requests, see drbd_rs_replies_received() */
+int w_resync_refill(struct drbd_work *w, int cancel)
+{
+	struct drbd_peer_device *peer_device =
+		container_of(w, struct drbd_peer_device, resync_refill_work);
+
+	make_resync_or_ov_requests(peer_device, cancel, true);
 	return 0;
 }
 
@@ -603,6 +800,210 @@ static int drbd_rs_controller(struct drbd_peer_device *peer_device, unsigned int
 	return req_sect;
 }
 
+/*
+ * Model based resync controller.
+ *
+ * Instead of filling up to static c_fill_target or c_delay_target values,
+ * estimate the bottleneck bandwidth (windowed maximum of the resync reply
+ * rate) and the round trip time of resync requests (time from sending a
+ * batch of requests until the replies covering it are in, windowed minimum).
+ * Keep two bandwidth delay products in flight, and request at about the
+ * estimated bandwidth, periodically probing for more.
+ *
+ * While application writes to this device take longer than
+ * drbd_resync_latency_target, or writing the resync data to the local disk
+ * does, the resync backs off multiplicatively and recovers additively.
+ */
+#define RS_MODEL_MIN_RTT_EXPIRE_US	(10 * USEC_PER_SEC)
+#define RS_MODEL_STARTUP_GAIN	289	/* percent, 2/ln(2) as in BBR */
+
+static const unsigned int rs_model_pacing_gain[] = { 125, 75, 100, 100, 100, 100, 100, 100 };
+
+static void rs_model_rtt_sample(struct rs_model *m, unsigned int rtt_us, ktime_t now)
+{
+	m->srtt_us = m->srtt_us ? m->srtt_us - (m->srtt_us >> 3) + (rtt_us >> 3) : rtt_us;
+	if (!m->min_rtt_us || rtt_us <= m->min_rtt_us ||
+	    ktime_us_delta(now, m->min_rtt_kt) > RS_MODEL_MIN_RTT_EXPIRE_US) {
+		m->min_rtt_us = max(rtt_us, 1U);
+		m->min_rtt_kt = now;
+	}
+}
+
+/* A batch of resync requests was sent, see make_resync_request() */
+static void rs_model_issued(struct drbd_peer_device *peer_device, unsigned int sectors)
+{
+	struct rs_model *m = &peer_device->rs_model;
+	unsigned int next;
+
+	if (!sectors)
+		return;
+
+	spin_lock(&peer_device->rs_model_lock);
+	m->issued += sectors;
+	next = (m->mark_head + 1) % RS_MODEL_MARKS;
+	if (next == m->mark_tail) {
+		/* all marks in use, extend the newest one */
+		m->marks[(m->mark_head + RS_MODEL_MARKS - 1) % RS_MODEL_MARKS].issued = m->issued;
+	} else {
+		m->marks[m->mark_head].issued = m->issued;
+		m->marks[m->mark_head].kt = ktime_get();
+		m->mark_head = next;
+	}
+	spin_unlock(&peer_device->rs_model_lock);
+}
+
+static void rs_model_received(struct drbd_peer_device *peer_device, unsigned int sectors)
+{
+	struct rs_model *m = &peer_device->rs_model;
+	ktime_t now;
+
+	now = ktime_get();
+	spin_lock(&peer_device->rs_model_lock);
+	m->received += sectors;
+	while (m->mark_tail != m->mark_head &&
+	       m->marks[m->mark_tail].issued <= m->received) {
+		rs_model_rtt_sample(m, ktime_us_delta(now, m->marks[m->mark_tail].kt), now);
+		m->mark_tail = (m->mark_tail + 1) % RS_MODEL_MARKS;
+	}
+	spin_unlock(&peer_device->rs_model_lock);
+}
+
+/* A resync write to the local disk completed, jif after its submission.
+ * Called from endio context, a lost update does not hurt. */
+void drbd_rs_model_disk_sample(struct drbd_peer_device *peer_device, unsigned long jif)
+{
+	struct rs_model *m = &peer_device->rs_model;
+	unsigned int us = jiffies_to_usecs(jif);
+
+	if (drbd_resync_controller != RS_CONTROLLER_MODEL)
+		return;
+
+	m->disk_us = m->disk_us - (m->disk_us >> 3) + (us >> 3);
+}
+
+/* rs_in_flight is only updated on the SLEEP_TIME tick, rs_sect_in counts
+ * the replies since then */
+static int drbd_rs_in_flight_now(struct drbd_peer_device *peer_device)
+{
+	return peer_device->rs_in_flight - atomic_read(&peer_device->rs_sect_in);
+}
+
+/* Replies to resync requests came in, called next to each rs_sect_in update.
+ *
+ * With drbd_resync_refill, do not wait for the next SLEEP_TIME tick to
+ * send what is left of the tick's budget, but send it as soon as the
+ * window the controller chose on its last tick has room again. Do that in
+ * batches of at least an eighth of the window, to not wake the sender for
+ * every reply. */
+void drbd_rs_replies_received(struct drbd_peer_device *peer_device, unsigned int sectors)
+{
+	int window = peer_device->rs_window;
+
+	if (drbd_resync_controller == RS_CONTROLLER_MODEL)
+		rs_model_received(peer_device, sectors);
+
+	if (drbd_resync_refill && window > 0 && READ_ONCE(peer_device->rs_tick_left) > 0 &&
+	    window - drbd_rs_in_flight_now(peer_device) >= max(window >> 3, BM_SECT_PER_BIT))
+		drbd_queue_work_if_unqueued(&peer_device->connection->sender_work,
+					    &peer_device->resync_refill_work);
+}
+
+/* Smoothed latency of application writes.  Without new writes the last
+ * value would keep the resync at the floor for ever; it fades by a quarter
+ * per controller tick instead. */
+static unsigned int rs_model_write_lat(struct drbd_device *device, ktime_t now)
+{
+	unsigned long flags;
+	unsigned int lat;
+
+	spin_lock_irqsave(&device->timing_lock, flags);
+	if (ktime_us_delta(now, device->write_lat_kt) > jiffies_to_usecs(SLEEP_TIME))
+		device->write_lat_us -= device->write_lat_us >> 2;
+	lat = device->write_lat_us;
+	spin_unlock_irqrestore(&device->timing_lock, flags);
+
+	return lat;
+}
+
+static int drbd_rs_model_controller(struct drbd_peer_device *peer_device, unsigned int sect_in)
+{
+	struct rs_model *m = &peer_device->rs_model;
+	struct peer_device_conf *pdc = rcu_dereference(peer_device->conf);
+	unsigned int latency_target = drbd_resync_latency_target;
+	unsigned int max_bw = 0, pacing_gain, i;
+	ktime_t now = ktime_get();
+	s64 dt_us;
+	u64 bdp, in_flight, req_sect;
+	int max_sect;
+
+	spin_lock(&peer_device->rs_model_lock);
+	dt_us = ktime_us_delta(now, m->last_kt);
+	m->last_kt = now;
+
+	/* delivery rate during the last tick */
+	if (dt_us > 0 && dt_us < 10 * USEC_PER_SEC) {
+		m->bw[m->bw_idx] = div64_u64((u64)sect_in * USEC_PER_SEC, dt_us);
+		m->bw_idx = (m->bw_idx + 1) % RS_MODEL_BW_WINDOW;
+	}
+	for (i = 0; i < RS_MODEL_BW_WINDOW; i++)
+		max_bw = max(max_bw, m->bw[i]);
+	m->btl_bw = max_bw;
+
+	/* the startup phase ends once the bandwidth stops growing */
+	if (m->startup) {
+		if (max_bw >= m->full_bw + m->full_bw / 4) {
+			m->full_bw = max_bw;
+			m->full_bw_cnt = 0;
+		} else if (++m->full_bw_cnt >= 3) {
+			m->startup = false;
+		}
+	}
+
+	if (latency_target &&
+	    (rs_model_write_lat(peer_device->device, now) > latency_target ||
+	     m->disk_us > latency_target))
+		m->scale = max(m->scale * 3 / 4, 5U);
+	else
+		m->scale = min(m->scale + 5, 100U);
+
+	if (!max_bw || !m->min_rtt_us) {
+		/* No estimate yet, start out like the plan-ahead controller */
+		req_sect = (pdc->resync_rate * 2 * SLEEP_TIME) / HZ;
+		m->target = req_sect;
+		m->pace = req_sect;
+		goto out;
+	}
+
+	pacing_gain = m->startup ? RS_MODEL_STARTUP_GAIN :
+		rs_model_pacing_gain[m->cycle++ % ARRAY_SIZE(rs_model_pacing_gain)];
+
+	bdp = div_u64((u64)max_bw * m->min_rtt_us, USEC_PER_SEC);
+	m->target = max_t(u64, 2 * bdp * m->scale / 100, BM_SECT_PER_BIT);
+	m->pace = max_t(u64, div_u64((u64)max_bw * pacing_gain * m->scale * SLEEP_TIME,
+				     100 * 100 * HZ), BM_SECT_PER_BIT);
+
+	in_flight = max(peer_device->rs_in_flight, 0);
+	req_sect = m->target > in_flight ? m->target - in_flight : 0;
+	req_sect = min_t(u64, req_sect, m->pace);
+out:
+	spin_unlock(&peer_device->rs_model_lock);
+
+	max_sect = (pdc->c_max_rate * 2 * SLEEP_TIME) / HZ;
+	return min_t(u64, req_sect, max_sect);
+}
+
+static void rs_model_reset(struct drbd_peer_device *peer_device)
+{
+	struct rs_model *m = &peer_device->rs_model;
+
+	spin_lock(&peer_device->rs_model_lock);
+	memset(m, 0, sizeof(*m));
+	m->last_kt = ktime_get();
+	m->scale = 100;
+	m->startup = true;
+	spin_unlock(&peer_device->rs_model_lock);
+}
+
 static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 {
 	struct net_conf *nc;
@@ -616,7 +1017,11 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	nc = rcu_dereference(peer_device->connection->transport.net_conf);
 	mxb = nc ? nc->max_buffers : 0;
 	if (rcu_dereference(peer_device->rs_plan_s)->size) {
-		number = drbd_rs_controller(peer_device, sect_in) >> (BM_BLOCK_SHIFT - 9);
+		if (drbd_resync_controller == RS_CONTROLLER_MODEL)
+			number = drbd_rs_model_controller(peer_device, sect_in);
+		else
+			number = drbd_rs_controller(peer_device, sect_in);
+		number >>= BM_BLOCK_SHIFT - 9;
 		peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / SLEEP_TIME;
 	} else {
 		peer_device->c_sync_rate = rcu_dereference(peer_device->conf)->resync_rate;
@@ -636,10 +1041,236 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	if (mxb - peer_device->rs_in_flight/8 < number)
 		number = mxb - peer_device->rs_in_flight/8;
 
+	/* what we want in flight until the next tick, see drbd_rs_replies_received() */
+	peer_device->rs_window = peer_device->rs_in_flight +
+		(max(number, 0) << (BM_BLOCK_SHIFT - 9));
+	peer_device->rs_tick_left = max(number, 0);
+
 	return number;
 }
 
-static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
+/* Number of requests to send in between two ticks. Replies make room in
+ * the window, but the rate is what the controller allowed for this tick:
+ * never more than what is left of its budget. */
+static int drbd_rs_refill_requests(struct drbd_peer_device *peer_device)
+{
+	int number = (peer_device->rs_window - drbd_rs_in_flight_now(peer_device)) >>
+		(BM_BLOCK_SHIFT - 9);
+
+	return min(number, peer_device->rs_tick_left);
+}
+
+/* Caller holds bm_resync_fo_mutex. */
+static void rs_issued(struct drbd_peer_device *peer_device, int number)
+{
+	peer_device->rs_in_flight += (number << (BM_BLOCK_SHIFT - 9));
+	peer_device->rs_tick_left = max(peer_device->rs_tick_left - number, 0);
+	rs_model_issued(peer_device, number << (BM_BLOCK_SHIFT - 9));
+}
+
+/* make_resync_request() looks at the bitmap once to find the next dirty bit,
+ * and once more for the length of the run starting there.  Instead of taking
+ * bm_lock for each, keep a copy of the bitmap words around the current
+ * position, and answer both from that.
+ * The copy is only used within one call of make_resync_request(), which holds
+ * bm_resync_fo_mutex.  That keeps P_OUT_OF_SYNC from setting bits behind
+ * our back; a bit cleared meanwhile costs one superfluous request at most. */
+static unsigned long rs_bm_find_next(struct drbd_peer_device *peer_device, unsigned long start)
+{
+	struct drbd_device *device = peer_device->device;
+	struct rs_bm_window *w = &peer_device->rs_bm_window;
+	unsigned long bit;
+
+	if (w->gen == device->rs_bm_window_gen && start >= w->start && start < w->end) {
+		bit = find_next_bit_le(w->words, w->end - w->start, start - w->start);
+		if (bit < w->end - w->start)
+			return w->start + bit;
+		start = w->end;
+	}
+
+	bit = drbd_bm_find_next_window(peer_device, start, w->words, RS_BM_WINDOW_BITS);
+	if (bit != DRBD_END_OF_BITMAP) {
+		w->start = bit & ~(RS_BM_WINDOW_BITS - 1UL);
+		w->end = min(w->start + RS_BM_WINDOW_BITS, drbd_bm_bits(device));
+		w->gen = device->rs_bm_window_gen;
+	}
+	return bit;
+}
+
+static int rs_bm_run_length(struct drbd_peer_device *peer_device, unsigned long bit, int max_bits)
+{
+	struct rs_bm_window *w = &peer_device->rs_bm_window;
+	unsigned long end, zero;
+	int run, more;
+
+	if (w->gen != peer_device->device->rs_bm_window_gen || bit < w->start || bit >= w->end)
+		return drbd_bm_run_length(peer_device, bit, max_bits);
+
+	end = min(bit + max_bits, w->end);
+	zero = w->start + find_next_zero_bit_le(w->words, end - w->start, bit - w->start);
+	run = zero - bit;
+	if (zero == w->end && run < max_bits) {
+		/* the run continues beyond the window */
+		more = drbd_bm_run_length(peer_device, zero, max_bits - run);
+		if (more > 0)
+			run += more;
+	}
+	return run;
+}
+
+/* In a multi-source resync, all co-sources share device->bm_resync_fo and
+ * look for work in the union of their bitmaps. Whoever comes first requests
+ * a block, so each source gets a share that matches its throughput. */
+static unsigned long rs_find_next(struct drbd_peer_device *peer_device, unsigned long start)
+{
+	unsigned long bit = rs_bm_find_next(peer_device, start);
+	struct drbd_peer_device *p;
+
+	if (!is_rs_co_source(peer_device, NOW))
+		return bit;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, peer_device->device) {
+		if (p != peer_device && is_rs_co_source(p, NOW))
+			bit = min(bit, rs_bm_find_next(p, start));
+	}
+	rcu_read_unlock();
+
+	return bit;
+}
+
+/* Every block of the returned run is dirty in at least one co-source bitmap */
+static int rs_run_length(struct drbd_peer_device *peer_device, unsigned long bit, int max_bits)
+{
+	int run = rs_bm_run_length(peer_device, bit, max_bits);
+	struct drbd_peer_device *p;
+
+	if (!is_rs_co_source(peer_device, NOW))
+		return run;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, peer_device->device) {
+		if (p != peer_device && is_rs_co_source(p, NOW))
+			run = max(run, rs_bm_run_length(p, bit, max_bits));
+	}
+	rcu_read_unlock();
+
+	return run;
+}
+
+static bool rs_hot_served(struct drbd_peer_device *peer_device, unsigned long bit)
+{
+	unsigned int enr = bit / BM_BITS_PER_AL_EXT;
+	unsigned int i;
+
+	for (i = 0; i < peer_device->rs_hot_nr; i++)
+		if (peer_device->rs_hot_served[i] == enr)
+			return true;
+	return false;
+}
+
+/* The extent with the most application IO recently that the sweep did not
+ * get to yet, or -1.  Decays the heat of all extents, so that only recent
+ * IO counts. */
+static int rs_pick_hot_extent(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	unsigned int i, best_heat = 1;
+	int best = -1;
+
+	for (i = 0; i < ARRAY_SIZE(device->heat); i++) {
+		struct drbd_heat_slot *slot = &device->heat[i];
+		unsigned int heat = READ_ONCE(slot->heat);
+		unsigned int enr = READ_ONCE(slot->enr);
+		unsigned long start = (unsigned long)enr * BM_BITS_PER_AL_EXT;
+
+		WRITE_ONCE(slot->heat, heat - (heat >> 2));
+		if (heat <= best_heat || start < device->bm_resync_fo ||
+		    start >= drbd_bm_bits(device) || rs_hot_served(peer_device, start))
+			continue;
+		best_heat = heat;
+		best = enr;
+	}
+	return best;
+}
+
+/* With resync_by_heat, the SyncTarget requests the out of sync blocks of
+ * the extents the application uses most first, one extent at a time, and
+ * at most RS_HOT_MAX extents per resync.  The linear sweep from
+ * bm_resync_fo skips these extents later, see rs_hot_served(), so that
+ * every block is still requested only once.
+ * A new hot extent is looked for only once per call of make_resync_request(). */
+static unsigned long rs_find_next_hot(struct drbd_peer_device *peer_device, bool *may_pick)
+{
+	unsigned long bit, start;
+	int enr;
+
+	if (!drbd_resync_by_heat || is_rs_co_source(peer_device, NOW))
+		return DRBD_END_OF_BITMAP;
+
+	if (peer_device->rs_hot_active) {
+		start = (unsigned long)peer_device->rs_hot_enr * BM_BITS_PER_AL_EXT;
+		bit = drbd_bm_find_next(peer_device, peer_device->rs_hot_fo);
+		if (bit < start + BM_BITS_PER_AL_EXT)
+			return bit;
+		peer_device->rs_hot_active = false;
+	}
+
+	if (!*may_pick || peer_device->rs_hot_nr == RS_HOT_MAX)
+		return DRBD_END_OF_BITMAP;
+	*may_pick = false;
+
+	enr = rs_pick_hot_extent(peer_device);
+	if (enr < 0)
+		return DRBD_END_OF_BITMAP;
+	start = (unsigned long)enr * BM_BITS_PER_AL_EXT;
+	bit = drbd_bm_find_next(peer_device, start);
+	if (bit >= start + BM_BITS_PER_AL_EXT)
+		return DRBD_END_OF_BITMAP;
+
+	peer_device->rs_hot_served[peer_device->rs_hot_nr++] = enr;
+	peer_device->rs_hot_enr = enr;
+	peer_device->rs_hot_active = true;
+	return bit;
+}
+
+static void rs_set_fo(struct drbd_peer_device *peer_device, bool hot, unsigned long bit)
+{
+	if (hot)
+		peer_device->rs_hot_fo = bit;
+	else
+		peer_device->device->bm_resync_fo = bit;
+}
+
+/* Make sure bit is requested again: a request was canceled by the peer,
+ * or the block became out of sync again.  The sweep skips the extents
+ * resync_by_heat served already, so rewind the hot extent if bit is in the
+ * active one, or forget that a finished one was served.
+ * Caller holds bm_resync_fo_mutex. */
+void drbd_rs_rewind(struct drbd_peer_device *peer_device, unsigned long bit)
+{
+	struct drbd_device *device = peer_device->device;
+	unsigned int enr = bit / BM_BITS_PER_AL_EXT;
+	unsigned int i;
+
+	if (bit < device->bm_resync_fo)
+		device->bm_resync_fo = bit;
+
+	for (i = 0; i < peer_device->rs_hot_nr; i++) {
+		if (peer_device->rs_hot_served[i] != enr)
+			continue;
+		if (peer_device->rs_hot_active && peer_device->rs_hot_enr == enr)
+			peer_device->rs_hot_fo = min(peer_device->rs_hot_fo, bit);
+		else
+			peer_device->rs_hot_served[i] =
+				peer_device->rs_hot_served[--peer_device->rs_hot_nr];
+		break;
+	}
+}
+
+/* With refill, we are called from w_resync_refill() in between the
+ * SLEEP_TIME ticks of the resync timer, which we leave alone. */
+static int make_resync_request(struct drbd_peer_device *peer_device, int cancel, bool refill)
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_transport *transport = &peer_device->connection->transport;
@@ -648,13 +1279,17 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	const sector_t capacity = drbd_get_capacity(device->this_bdev);
 	int max_bio_size;
 	int number, rollback_i, size;
-	int align, requeue = 0;
+	int max_bits, run, requeue = 0;
 	int i = 0;
 	int discard_granularity = 0;
+	bool hot, may_pick = true;
 
 	if (unlikely(cancel))
 		return 0;
 
+	/* invalidate the bitmap copies of the previous call, see rs_bm_find_next() */
+	device->rs_bm_window_gen++;
+
 	if (peer_device->rs_total == 0) {
 		/* empty resync? */
 		drbd_resync_finished(peer_device, D_MASK);
@@ -677,7 +1312,7 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	}
 
 	max_bio_size = queue_max_hw_sectors(device->rq_queue) << 9;
-	number = drbd_rs_number_requests(peer_device);
+	number = refill ? drbd_rs_refill_requests(peer_device) : drbd_rs_number_requests(peer_device);
 	if (number <= 0)
 		goto requeue;
 
@@ -703,7 +1338,13 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 
 next_sector:
 		size = BM_BLOCK_SIZE;
-		bit  = drbd_bm_find_next(peer_device, device->bm_resync_fo);
+		bit = rs_find_next_hot(peer_device, &may_pick);
+		hot = bit != DRBD_END_OF_BITMAP;
+		if (!hot) {
+			bit = rs_find_next(peer_device, device->bm_resync_fo);
+			while (bit != DRBD_END_OF_BITMAP && rs_hot_served(peer_device, bit))
+				bit = rs_find_next(peer_device, round_up(bit + 1, BM_BITS_PER_AL_EXT));
+		}
 
 		if (bit == DRBD_END_OF_BITMAP) {
 			device->bm_resync_fo = drbd_bm_bits(device);
@@ -714,57 +1355,48 @@ next_sector:
 		sector = BM_BIT_TO_SECT(bit);
 
 		if (drbd_try_rs_begin_io(peer_device, sector, true)) {
-			device->bm_resync_fo = bit;
+			rs_set_fo(peer_device, hot, bit);
 			goto requeue;
 		}
-		device->bm_resync_fo = bit + 1;
-
-		if (unlikely(drbd_bm_test_bit(peer_device, bit) == 0)) {
-			drbd_rs_complete_io(peer_device, sector);
-			goto next_sector;
-		}
+		rs_set_fo(peer_device, hot, bit + 1);
 
+		max_bits = 1;
 #if DRBD_MAX_BIO_SIZE > BM_BLOCK_SIZE
 		/* try to find some adjacent bits.
 		 * we stop if we have already the maximum req size.
 		 *
 		 * Additionally always align bigger requests, in order to
-		 * be prepared for all stripe sizes of software RAIDs.
+		 * be prepared for all stripe sizes of software RAIDs:
+		 * a request never grows beyond the alignment of its first bit.
+		 *
+		 * All limits are known up front, so the bitmap is looked at
+		 * only once for the whole request, see rs_bm_run_length().
 		 */
-		align = 1;
+		max_bits = min(number - i, max_bio_size >> BM_BLOCK_SHIFT);
+		if (bit & BM_BLOCKS_PER_BM_EXT_MASK)
+			max_bits = min_t(unsigned long, max_bits, bit & -bit);
+		/* do not cross extent boundaries */
+		max_bits = min_t(unsigned long, max_bits,
+				 BM_BITS_PER_EXT - (bit & BM_BLOCKS_PER_BM_EXT_MASK));
+		if (discard_granularity >= BM_BLOCK_SIZE)
+			max_bits = min(max_bits, discard_granularity >> BM_BLOCK_SHIFT);
+		max_bits = max(max_bits, 1);
+#endif
+		/* now, is it actually dirty, after all? */
+		run = rs_run_length(peer_device, bit, max_bits);
+		if (unlikely(run <= 0)) {
+			drbd_rs_complete_io(peer_device, sector);
+			goto next_sector;
+		}
 		rollback_i = i;
-		while (i < number) {
-			if (size + BM_BLOCK_SIZE > max_bio_size)
-				break;
-
-			/* Be always aligned */
-			if (sector & ((1<<(align+3))-1))
-				break;
-
-			if (discard_granularity && size == discard_granularity)
-				break;
-
-			/* do not cross extent boundaries */
-			if (((bit+1) & BM_BLOCKS_PER_BM_EXT_MASK) == 0)
-				break;
-			/* now, is it actually dirty, after all?
-			 * caution, drbd_bm_test_bit is tri-state for some
-			 * obscure reason; ( b == 0 ) would get the out-of-band
-			 * only accidentally right because of the "oddly sized"
-			 * adjustment below */
-			if (drbd_bm_test_bit(peer_device, bit + 1) != 1)
-				break;
-			bit++;
-			size += BM_BLOCK_SIZE;
-			if ((BM_BLOCK_SIZE << align) <= size)
-				align++;
-			i++;
+		if (run > 1) {
+			size = run << BM_BLOCK_SHIFT;
+			bit += run - 1;
+			i += run - 1;
+			/* if we merged some,
+			 * reset the offset to start the next drbd_bm_find_next from */
+			rs_set_fo(peer_device, hot, bit + 1);
 		}
-		/* if we merged some,
-		 * reset the offset to start the next drbd_bm_find_next from */
-		if (size > BM_BLOCK_SIZE)
-			device->bm_resync_fo = bit + 1;
-#endif
 
 		/* adjust very last sectors, in case we are oddly sized */
 		if (sector + (size>>9) > capacity)
@@ -777,7 +1409,7 @@ next_sector:
 				return -EIO;
 			case -EAGAIN: /* allocation failed, or ldev busy */
 				drbd_rs_complete_io(peer_device, sector);
-				device->bm_resync_fo = BM_SECT_TO_BIT(sector);
+				rs_set_fo(peer_device, hot, BM_SECT_TO_BIT(sector));
 				i = rollback_i;
 				goto requeue;
 			case 0:
@@ -814,13 +1446,110 @@ next_sector:
 	}
 
  requeue:
-	peer_device->rs_in_flight += (i << (BM_BLOCK_SHIFT - 9));
-	mod_timer(&peer_device->resync_timer, jiffies + SLEEP_TIME);
+	rs_issued(peer_device, i);
+	if (!refill)
+		mod_timer(&peer_device->resync_timer, jiffies + SLEEP_TIME);
 	put_ldev(device);
 	return 0;
 }
 
-static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
+/* Hierarchical online verify: ask for digests of DRBD_OV_TREE_SIZE aligned
+ * ranges, and for sub-ranges of those that differed, see ov_descend().
+ * Both sides still read everything, but for mostly identical replicas
+ * only one digest per range travels, instead of one per bitmap block.
+ *
+ * Returns the number of BM_BLOCK_SIZE blocks asked for, which is what
+ * the resync controller budgets in, or -EIO. */
+static int make_ov_tree_requests(struct drbd_peer_device *peer_device, int number)
+{
+	struct drbd_device *device = peer_device->device;
+	const sector_t capacity = drbd_get_capacity(device->this_bdev);
+	int credit = peer_device->ov_tree_credit + number;
+	sector_t sector;
+	int i = 0;
+
+	while (credit > 0) {
+		struct ov_range *r = NULL;
+		unsigned int size;
+		int bits;
+
+		if (peer_device->ov_descend_head != peer_device->ov_descend_tail) {
+			r = &peer_device->ov_descend[peer_device->ov_descend_head % OV_DESCEND_MAX];
+			sector = r->sector;
+			size = min(r->size, r->child_size);
+		} else {
+			sector = peer_device->ov_position;
+			if (sector >= capacity)
+				break;
+			/* We need to send at least one request out,
+			 * see w_e_end_ov_reply() */
+			if (verify_can_do_stop_sector(peer_device) &&
+			    sector >= peer_device->ov_stop_sector &&
+			    sector != peer_device->ov_start_sector)
+				break;
+
+			size = DRBD_OV_TREE_SIZE - ((sector << 9) & (DRBD_OV_TREE_SIZE - 1));
+			if (verify_can_do_stop_sector(peer_device) &&
+			    peer_device->ov_stop_sector > sector &&
+			    peer_device->ov_stop_sector - sector < (size >> 9))
+				size = round_up(peer_device->ov_stop_sector - sector, BM_SECT_PER_BIT) << 9;
+			if (sector + (size >> 9) > capacity)
+				size = (capacity - sector) << 9;
+		}
+
+		/* A range may be larger than what the controller allows per
+		 * tick; then save up over the next ticks instead of
+		 * overrunning the rate. */
+		bits = DIV_ROUND_UP(size, BM_BLOCK_SIZE);
+		if (bits > credit)
+			break;
+
+		if (drbd_try_rs_begin_io(peer_device, sector, true))
+			break;
+
+		inc_rs_pending(peer_device);
+		if (drbd_send_ov_request(peer_device, sector, size)) {
+			dec_rs_pending(peer_device);
+			return -EIO;
+		}
+		peer_device->ov_tree_pending++;
+		credit -= bits;
+		i += bits;
+
+		if (r) {
+			r->sector += size >> 9;
+			r->size -= size;
+			if (!r->size)
+				peer_device->ov_descend_head++;
+		} else {
+			peer_device->ov_position = sector + (size >> 9);
+		}
+	}
+
+	/* save up at most for one full range */
+	peer_device->ov_tree_credit = clamp_t(int, credit, 0, DRBD_OV_TREE_SIZE >> BM_BLOCK_SHIFT);
+	return i;
+}
+
+/* The digests of this range differed, queue its sub-ranges.
+ * Returns false if we can not, the caller then treats it as out of sync. */
+static bool ov_descend(struct drbd_peer_device *peer_device, sector_t sector, unsigned int size)
+{
+	struct ov_range *r;
+
+	if (size <= BM_BLOCK_SIZE ||
+	    peer_device->ov_descend_tail - peer_device->ov_descend_head >= OV_DESCEND_MAX)
+		return false;
+
+	r = &peer_device->ov_descend[peer_device->ov_descend_tail % OV_DESCEND_MAX];
+	r->sector = sector;
+	r->size = size;
+	r->child_size = round_up(size / DRBD_OV_TREE_FANOUT, BM_BLOCK_SIZE);
+	peer_device->ov_descend_tail++;
+	return true;
+}
+
+static int make_ov_request(struct drbd_peer_device *peer_device, int cancel, bool refill)
 {
 	struct drbd_device *device = peer_device->device;
 	int number, i, size;
@@ -831,7 +1560,14 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 	if (unlikely(cancel))
 		return 1;
 
-	number = drbd_rs_number_requests(peer_device);
+	number = refill ? drbd_rs_refill_requests(peer_device) : drbd_rs_number_requests(peer_device);
+
+	if (peer_device->ov_tree) {
+		i = make_ov_tree_requests(peer_device, number);
+		if (i < 0)
+			return 0;
+		goto requeue;
+	}
 
 	sector = peer_device->ov_position;
 	for (i = 0; i < number; i++) {
@@ -867,8 +1603,9 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 	peer_device->ov_position = sector;
 
  requeue:
-	peer_device->rs_in_flight += (i << (BM_BLOCK_SHIFT - 9));
-	if (i == 0 || !stop_sector_reached)
+	rs_issued(peer_device, i);
+	/* with ov_tree, sub-ranges may show up until the very end */
+	if (!refill && (i == 0 || !stop_sector_reached || peer_device->ov_tree))
 		mod_timer(&peer_device->resync_timer, jiffies + SLEEP_TIME);
 	return 1;
 }
@@ -1013,6 +1750,86 @@ static void init_resync_stable_bits(struct drbd_peer_device *first_target_pd)
 	clear_bit(STABLE_RESYNC, &device->flags);
 }
 
+/* Is another source of our multi-source resync still at it? */
+static bool other_co_source_active(struct drbd_peer_device *peer_device)
+{
+	struct drbd_peer_device *p;
+	bool rv = false;
+
+	if (!is_rs_co_source(peer_device, NOW))
+		return false;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, peer_device->device) {
+		if (p != peer_device && is_rs_co_source(p, NOW)) {
+			rv = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return rv;
+}
+
+/* A co-source joining a running multi-source resync continues at the
+ * shared bm_resync_fo; its bits in [0, bm_resync_fo) would never be
+ * requested, and its resync would never finish.  Where none of the other
+ * co-sources has a bit set any more, the block was written from one of
+ * them, or never differed, so it is in sync with the joining one as well:
+ * clear those bits.  What the others still have set is in flight or
+ * failed; rewind to the first of these, so that it is requested again.
+ * If any co-source is unstable, its data may differ from the joining one;
+ * sweep again from the start instead. */
+static void rs_join_co_sources(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	bool stable = !test_bit(UNSTABLE_RESYNC, &peer_device->flags);
+	unsigned long fo, start, next, bit;
+	struct drbd_peer_device *p;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, device) {
+		if (p != peer_device && is_rs_co_source(p, NOW) &&
+		    test_bit(UNSTABLE_RESYNC, &p->flags))
+			stable = false;
+	}
+	rcu_read_unlock();
+
+	mutex_lock(&device->bm_resync_fo_mutex);
+	fo = stable ? device->bm_resync_fo : 0;
+	for (start = 0; start < fo; start = next + 1) {
+		next = fo;
+		rcu_read_lock();
+		for_each_peer_device_rcu(p, device) {
+			if (p != peer_device && drbd_rs_co_source_of_round(p))
+				next = min(next, drbd_bm_find_next(p, start));
+		}
+		rcu_read_unlock();
+		if (next > start)
+			drbd_bm_clear_many_bits(peer_device, start, next - 1);
+	}
+	bit = drbd_bm_find_next(peer_device, 0);
+	device->bm_resync_fo = min(fo, bit);
+	mutex_unlock(&device->bm_resync_fo_mutex);
+
+	peer_device->rs_total = drbd_bm_total_weight(peer_device);
+}
+
+/* Now the two UUID sets are equal, update what we know of the peer. */
+static void update_peer_uuids_after_resync(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	const int node_id = device->resource->res_opts.node_id;
+	int i;
+
+	drbd_print_uuids(peer_device, "updated UUIDs");
+	peer_device->current_uuid = drbd_current_uuid(device);
+	peer_device->bitmap_uuids[node_id] = drbd_bitmap_uuid(peer_device);
+	for (i = 0; i < ARRAY_SIZE(peer_device->history_uuids); i++)
+		peer_device->history_uuids[i] =
+			drbd_history_uuid(device, i);
+}
+
 int drbd_resync_finished(struct drbd_peer_device *peer_device,
 			 enum drbd_disk_state new_peer_disk_state)
 {
@@ -1102,7 +1919,21 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 			khelper_cmd = "out-of-sync";
 		}
 	} else {
-		D_ASSERT(peer_device, (n_oos - peer_device->rs_failed) == 0);
+		D_ASSERT(peer_device, (n_oos - peer_device->rs_failed) == 0 ||
+			 test_bit(RS_CO_SOURCE_LEFT, &peer_device->flags));
+
+		if ((repl_state[NOW] == L_SYNC_TARGET || repl_state[NOW] == L_PAUSED_SYNC_T) &&
+		    other_co_source_active(peer_device)) {
+			/* All the others share our data. Leave the disk
+			 * state, the UUID transition and the handler to the
+			 * last one to finish, so it happens only once, and
+			 * only when everything arrived. Until then, what the
+			 * others deliver clears our bits as well, see
+			 * drbd_rs_co_source_of_round(). */
+			drbd_info(peer_device, "Other resync sources still active\n");
+			device->rs_co_sources_done |= NODE_MASK(peer_device->node_id);
+			goto out_unlock;
+		}
 
 		if (repl_state[NOW] == L_SYNC_TARGET || repl_state[NOW] == L_PAUSED_SYNC_T)
 			khelper_cmd = "after-resync-target";
@@ -1135,6 +1966,7 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 	} else {
 		if (repl_state[NOW] == L_SYNC_TARGET || repl_state[NOW] == L_PAUSED_SYNC_T) {
 			bool stable_resync = was_resync_stable(peer_device);
+
 			if (stable_resync)
 				__change_disk_state(device, peer_device->disk_state[NOW]);
 
@@ -1155,17 +1987,18 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 			}
 
 			if (stable_resync && peer_device->uuids_received) {
-				/* Now the two UUID sets are equal, update what we
-				 * know of the peer. */
-				const int node_id = device->resource->res_opts.node_id;
-				int i;
+				struct drbd_peer_device *p;
 
-				drbd_print_uuids(peer_device, "updated UUIDs");
-				peer_device->current_uuid = drbd_current_uuid(device);
-				peer_device->bitmap_uuids[node_id] = drbd_bitmap_uuid(peer_device);
-				for (i = 0; i < ARRAY_SIZE(peer_device->history_uuids); i++)
-					peer_device->history_uuids[i] =
-						drbd_history_uuid(device, i);
+				update_peer_uuids_after_resync(peer_device);
+
+				/* and of the co-sources that finished before us,
+				 * unless a block is still missing from them */
+				for_each_peer_device(p, device) {
+					if (p != peer_device && p->uuids_received &&
+					    drbd_rs_co_source_of_round(p) &&
+					    drbd_bm_total_weight(p) == 0)
+						update_peer_uuids_after_resync(p);
+				}
 			}
 		} else if (repl_state[NOW] == L_SYNC_SOURCE || repl_state[NOW] == L_PAUSED_SYNC_S) {
 			if (new_peer_disk_state != D_MASK)
@@ -1177,6 +2010,10 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 		}
 	}
 
+	/* the last one of a multi-source resync is done */
+	if (repl_state[NOW] == L_SYNC_TARGET || repl_state[NOW] == L_PAUSED_SYNC_T)
+		device->rs_co_sources_done = 0;
+
 out_unlock:
 	end_state_change_locked(device->resource);
 
@@ -1282,6 +2119,25 @@ int w_e_end_data_req(struct drbd_work *w, int cancel)
 	return err;
 }
 
+static bool page_all_zero(struct page *page, unsigned int offset, unsigned int len)
+{
+	unsigned int i, words = len / sizeof(long);
+	unsigned long *d;
+	void *addr;
+	bool zero = true;
+
+	addr = drbd_kmap_atomic(page, KM_USER1);
+	d = addr + offset;
+	for (i = 0; i < words; i++) {
+		if (d[i]) {
+			zero = false;
+			break;
+		}
+	}
+	drbd_kunmap_atomic(addr, KM_USER1);
+	return zero;
+}
+
 static bool all_zero(struct drbd_peer_request *peer_req)
 {
 	struct page *page = peer_req->page_chain.head;
@@ -1289,23 +2145,29 @@ static bool all_zero(struct drbd_peer_request *peer_req)
 
 	page_chain_for_each(page) {
 		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
-		unsigned int i, words = l / sizeof(long);
-		unsigned long *d;
-
-		d = drbd_kmap_atomic(page, KM_USER1);
-		for (i = 0; i < words; i++) {
-			if (d[i]) {
-				drbd_kunmap_atomic(d, KM_USER1);
-				return false;
-			}
-		}
-		drbd_kunmap_atomic(d, KM_USER1);
+
+		if (!page_all_zero(page, 0, l))
+			return false;
 		len -= l;
 	}
 
 	return true;
 }
 
+/* Used by drbd_send_dblock() to replicate zero filled writes as P_ZEROES */
+bool drbd_bio_all_zero(struct bio *bio)
+{
+	DRBD_BIO_VEC_TYPE bvec;
+	DRBD_ITER_TYPE iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		if (!page_all_zero(bvec BVD bv_page, bvec BVD bv_offset, bvec BVD bv_len))
+			return false;
+	}
+
+	return true;
+}
+
 /**
  * w_e_end_rsdata_req() - Worker callback to send a P_RS_DATA_REPLY packet in response to a P_RS_DATA_REQUEST
  * @w:		work object.
@@ -1334,7 +2196,8 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 	} else if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
 		if (likely(peer_device->disk_state[NOW] >= D_INCONSISTENT)) {
 			inc_rs_pending(peer_device);
-			if (peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req))
+			if (peer_req->flags & EE_RS_UNALLOCATED ||
+			    (peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req)))
 				err = drbd_send_rs_deallocated(peer_device, peer_req);
 			else
 				err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
@@ -1388,15 +2251,21 @@ int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 	di = peer_req->digest;
 
 	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
+		struct crypto_ahash *tfm = peer_device->connection->csums_tfm;
+
 		/* quick hack to try to avoid a race against reconfiguration.
 		 * a real fix would be much more involved,
 		 * introducing more locking mechanisms */
-		if (peer_device->connection->csums_tfm) {
-			digest_size = crypto_ahash_digestsize(peer_device->connection->csums_tfm);
+		if (peer_req->flags & EE_DIGEST_DONE) {
+			eq = !!(peer_req->flags & EE_DIGEST_EQUAL);
+		} else if (tfm) {
+			digest_size = crypto_ahash_digestsize(tfm);
 			D_ASSERT(device, digest_size == di->digest_size);
 			digest = kmalloc(digest_size, GFP_NOIO);
 			if (digest) {
-				drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+				drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+				drbd_csum_cache_insert(device, tfm, peer_req->i.sector, peer_req->i.size,
+						       peer_req->csum_cache_seq, digest);
 				eq = !memcmp(digest, di->digest, digest_size);
 				kfree(digest);
 			}
@@ -1432,6 +2301,7 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 {
 	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct crypto_ahash *tfm = peer_device->connection->verify_tfm;
 	int digest_size;
 	void *digest;
 	int err = 0;
@@ -1439,7 +2309,7 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 	if (unlikely(cancel))
 		goto out;
 
-	digest_size = crypto_ahash_digestsize(peer_device->connection->verify_tfm);
+	digest_size = crypto_ahash_digestsize(tfm);
 	/* FIXME if this allocation fails, online verify will not terminate! */
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (!digest) {
@@ -1447,10 +2317,15 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 		goto out;
 	}
 
-	if (!(peer_req->flags & EE_WAS_ERROR))
-		drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
-	else
+	if (peer_req->flags & EE_DIGEST_DONE) {
+		memcpy(digest, peer_req->digest->digest, digest_size);
+	} else if (!(peer_req->flags & EE_WAS_ERROR)) {
+		drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+		drbd_csum_cache_insert(peer_device->device, tfm, peer_req->i.sector,
+				       peer_req->i.size, peer_req->csum_cache_seq, digest);
+	} else {
 		memset(digest, 0, digest_size);
+	}
 
 	/* Free peer_req and pages before send.
 	 * In case we block on congestion, we could otherwise run into
@@ -1492,6 +2367,7 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	void *digest;
 	sector_t sector = peer_req->i.sector;
 	unsigned int size = peer_req->i.size;
+	u64 result;
 	int digest_size;
 	int err, eq = 0;
 	bool stop_sector_reached = false;
@@ -1511,11 +2387,17 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 
 	di = peer_req->digest;
 
-	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
-		digest_size = crypto_ahash_digestsize(peer_device->connection->verify_tfm);
+	if (peer_req->flags & EE_DIGEST_DONE) {
+		eq = !!(peer_req->flags & EE_DIGEST_EQUAL);
+	} else if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
+		struct crypto_ahash *tfm = peer_device->connection->verify_tfm;
+
+		digest_size = crypto_ahash_digestsize(tfm);
 		digest = kmalloc(digest_size, GFP_NOIO);
 		if (digest) {
-			drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+			drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+			drbd_csum_cache_insert(device, tfm, sector, size,
+					       peer_req->csum_cache_seq, digest);
 
 			D_ASSERT(device, digest_size == di->digest_size);
 			eq = !memcmp(digest, di->digest, digest_size);
@@ -1529,24 +2411,38 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	 * congestion as well, because our receiver blocks in
 	 * drbd_alloc_pages due to pp_in_use > max_buffers. */
 	drbd_free_peer_req(peer_req);
-	if (!eq)
-		drbd_ov_out_of_sync_found(peer_device, sector, size);
-	else
+	if (eq) {
 		ov_out_of_sync_print(peer_device);
+		result = ID_IN_SYNC;
+	} else if (peer_device->ov_tree && ov_descend(peer_device, sector, size)) {
+		result = ID_OV_DESCEND;
+	} else {
+		drbd_ov_out_of_sync_found(peer_device, sector, size);
+		result = ID_OUT_OF_SYNC;
+	}
 
-	err = drbd_send_ack_ex(peer_device, P_OV_RESULT, sector, size,
-			       eq ? ID_IN_SYNC : ID_OUT_OF_SYNC);
+	err = drbd_send_ack_ex(peer_device, P_OV_RESULT, sector, size, result);
 
 	dec_unacked(peer_device);
 
-	--peer_device->ov_left;
+	if (result != ID_OV_DESCEND)
+		drbd_ov_done(peer_device, size);
 
 	/* let's advance progress step marks only for every other megabyte */
 	if ((peer_device->ov_left & 0x200) == 0x200)
 		drbd_advance_rs_marks(peer_device, peer_device->ov_left);
 
-	stop_sector_reached = verify_can_do_stop_sector(peer_device) &&
-		(sector + (size>>9)) >= peer_device->ov_stop_sector;
+	if (peer_device->ov_tree) {
+		peer_device->ov_tree_pending--;
+		/* the last reply to come in, not the one for the last range */
+		stop_sector_reached = verify_can_do_stop_sector(peer_device) &&
+			peer_device->ov_position >= peer_device->ov_stop_sector &&
+			peer_device->ov_descend_head == peer_device->ov_descend_tail &&
+			peer_device->ov_tree_pending == 0;
+	} else {
+		stop_sector_reached = verify_can_do_stop_sector(peer_device) &&
+			(sector + (size>>9)) >= peer_device->ov_stop_sector;
+	}
 
 	if (peer_device->ov_left == 0 || stop_sector_reached) {
 		ov_out_of_sync_print(peer_device);
@@ -1795,6 +2691,8 @@ void drbd_rs_controller_reset(struct drbd_peer_device *peer_device)
 	atomic_set(&peer_device->rs_sect_in, 0);
 	atomic_set(&peer_device->device->rs_sect_ev, 0);  /* FIXME: ??? */
 	peer_device->rs_in_flight = 0;
+	peer_device->rs_window = 0;
+	peer_device->rs_tick_left = 0;
 	peer_device->rs_last_events =
 		drbd_backing_bdev_events(peer_device->device->ldev->backing_bdev->bd_contains->bd_disk);
 
@@ -1807,6 +2705,8 @@ void drbd_rs_controller_reset(struct drbd_peer_device *peer_device)
 	plan->total = 0;
 	fifo_set(plan, 0);
 	rcu_read_unlock();
+
+	rs_model_reset(peer_device);
 }
 
 void start_resync_timer_fn(unsigned long data)
@@ -2000,9 +2900,15 @@ void drbd_start_resync(struct drbd_peer_device *peer_device, enum drbd_repl_stat
 		     (unsigned long) peer_device->rs_total << (BM_BLOCK_SHIFT-10),
 		     (unsigned long) peer_device->rs_total);
 		if (side == L_SYNC_TARGET) {
-			device->bm_resync_fo = 0;
+			if (!other_co_source_active(peer_device)) {
+				device->bm_resync_fo = 0;
+				device->rs_co_sources_done = 0;
+			}
+			peer_device->rs_hot_active = false;
+			peer_device->rs_hot_nr = 0;
 			peer_device->use_csums = use_checksum_based_resync(connection, device);
 		} else {
+			clear_bit(RS_CO_SOURCE_LEFT, &peer_device->flags);
 			peer_device->use_csums = false;
 		}
 
@@ -2011,6 +2917,10 @@ void drbd_start_resync(struct drbd_peer_device *peer_device, enum drbd_repl_stat
 		    !drbd_stable_sync_source_present(peer_device, NOW))
 			set_bit(UNSTABLE_RESYNC, &peer_device->flags);
 
+		/* join a running multi-source resync where it is */
+		if (side == L_SYNC_TARGET && other_co_source_active(peer_device))
+			rs_join_co_sources(peer_device);
+
 		/* Since protocol 96, we must serialize drbd_gen_and_send_sync_uuid
 		 * with w_send_oos, or the sync target will get confused as to
 		 * how much bits to resync.  We cannot do that always, because for an
@@ -2091,6 +3001,7 @@ static void drbd_ldev_destroy(struct drbd_device *device)
         rcu_read_unlock();
         lc_destroy(device->act_log);
         device->act_log = NULL;
+	drbd_csum_cache_destroy(device);
 	__acquire(local);
 	drbd_backing_dev_free(device, device->ldev);
 	device->ldev = NULL;
@@ -2574,6 +3485,109 @@ static void maybe_send_barrier(struct drbd_connection *connection, unsigned int
 	}
 }
 
+static bool may_coalesce_write(struct drbd_request *req, unsigned int s)
+{
+	struct bio *bio = req->master_bio;
+
+	return (s & RQ_EXP_BARR_ACK) &&
+		bio && bio_op(bio) == REQ_OP_WRITE &&
+		!(bio->bi_opf & (DRBD_REQ_FUA | DRBD_REQ_PREFLUSH));
+}
+
+#define RQ_COALESCE_MASK (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK | RQ_EXP_BARR_ACK)
+
+/* Is next a write we can send within the same P_DATA packet as prev?
+ * It has to directly follow prev on disk and in the change stream,
+ * belong to the same epoch, and expect the same kind of acks. */
+static bool can_coalesce(struct drbd_peer_device *peer_device,
+			 struct drbd_request *prev, struct drbd_request *next)
+{
+	unsigned int s_prev = drbd_req_state_by_peer_device(prev, peer_device);
+	unsigned int s_next = drbd_req_state_by_peer_device(next, peer_device);
+
+	return next->device == prev->device &&
+		next->epoch == prev->epoch &&
+		next->i.sector == prev->i.sector + (prev->i.size >> 9) &&
+		next->dagtag_sector - (next->i.size >> 9) == prev->dagtag_sector &&
+		(s_next & RQ_COALESCE_MASK) == (s_prev & RQ_COALESCE_MASK) &&
+		may_coalesce_write(next, s_next);
+}
+
+static bool coalesce_candidate_queued(struct drbd_connection *connection,
+				      struct drbd_request *last)
+{
+	struct drbd_request *next;
+
+	spin_lock_irq(&connection->resource->req_lock);
+	next = __next_request_for_connection(connection, last);
+	spin_unlock_irq(&connection->resource->req_lock);
+
+	return next != NULL;
+}
+
+/* Collect writes queued for this connection, which directly follow req,
+ * so they can be sent as one P_DATA packet. This saves per packet overhead
+ * on both nodes, including a drbd_peer_request and P_WRITE_ACK on the peer.
+ *
+ * The coalesced requests are marked RQ_NET_COALESCED, so that the single
+ * ack from the peer, which covers the whole range, gets applied to all of
+ * them, see got_BlockAck().
+ *
+ * If nothing further is queued yet, wait for at most drbd_coalesce_writes_delay
+ * microseconds (counted from the submission of req) for more writes.
+ */
+static int coalesce_writes(struct drbd_connection *connection,
+			   struct drbd_peer_device *peer_device,
+			   struct drbd_request *req, struct drbd_request **more)
+{
+	struct drbd_resource *resource = connection->resource;
+	unsigned int max_size = drbd_coalesce_writes_kb << 10;
+	unsigned int delay = drbd_coalesce_writes_delay;
+	struct drbd_request *last = req, *next;
+	unsigned int size = req->i.size;
+	bool waited = false;
+	int n = 0;
+
+	if (!max_size || connection->integrity_tfm ||
+	    !may_coalesce_write(req, drbd_req_state_by_peer_device(req, peer_device)))
+		return 0;
+
+	max_size = min(max_size, peer_device->max_bio_size);
+
+	spin_lock_irq(&resource->req_lock);
+	while (n < DRBD_MAX_COALESCED_REQS - 1 && size < max_size) {
+		next = __next_request_for_connection(connection, last);
+		if (!next) {
+			s64 remaining = (s64)delay - ktime_us_delta(ktime_get(), req->start_kt);
+
+			if (waited || remaining <= 0)
+				break;
+			spin_unlock_irq(&resource->req_lock);
+			wait_event_interruptible_timeout(connection->sender_work.q_wait,
+					coalesce_candidate_queued(connection, last),
+					usecs_to_jiffies(remaining));
+			spin_lock_irq(&resource->req_lock);
+			waited = true;
+			continue;
+		}
+		if (!can_coalesce(peer_device, last, next) ||
+		    size + next->i.size > max_size)
+			break;
+
+		next->net_rq_state[peer_device->node_id] |= RQ_NET_COALESCED;
+		more[n++] = next;
+		size += next->i.size;
+		last = next;
+	}
+	spin_unlock_irq(&resource->req_lock);
+
+	if (n) {
+		connection->send.coalesced_packets++;
+		connection->send.coalesced_writes += n;
+	}
+	return n;
+}
+
 static int process_one_request(struct drbd_connection *connection)
 {
 	struct bio_and_error m;
@@ -2583,6 +3597,9 @@ static int process_one_request(struct drbd_connection *connection)
 			conn_peer_device(connection, device->vnr);
 	unsigned s = drbd_req_state_by_peer_device(req, peer_device);
 	bool do_send_unplug = req->local_rq_state & RQ_UNPLUG;
+	struct drbd_request *more[DRBD_MAX_COALESCED_REQS - 1];
+	struct bio_and_error more_m[DRBD_MAX_COALESCED_REQS - 1];
+	int n_more = 0, i;
 	int err;
 	enum drbd_req_event what;
 
@@ -2599,8 +3616,15 @@ static int process_one_request(struct drbd_connection *connection)
 			if (current_dagtag_sector != connection->send.current_dagtag_sector)
 				drbd_send_dagtag(connection, current_dagtag_sector);
 
-			connection->send.current_epoch_writes++;
-			connection->send.current_dagtag_sector = req->dagtag_sector;
+			n_more = coalesce_writes(connection, peer_device, req, more);
+			for (i = 0; i < n_more; i++) {
+				more[i]->pre_send_kt[peer_device->node_id] = ktime_get();
+				do_send_unplug |= more[i]->local_rq_state & RQ_UNPLUG;
+			}
+
+			connection->send.current_epoch_writes += 1 + n_more;
+			connection->send.current_dagtag_sector =
+				n_more ? more[n_more - 1]->dagtag_sector : req->dagtag_sector;
 
 			if (peer_device->todo.was_ahead) {
 				clear_bit(SEND_STATE_AFTER_AHEAD, &peer_device->flags);
@@ -2608,7 +3632,7 @@ static int process_one_request(struct drbd_connection *connection)
 				drbd_send_current_state(peer_device);
 			}
 
-			err = drbd_send_dblock(peer_device, req);
+			err = drbd_send_dblock(peer_device, req, more, n_more);
 			what = err ? SEND_FAILED : HANDED_OVER_TO_NETWORK;
 		} else {
 			/* this time, no connection->send.current_epoch_writes++;
@@ -2630,9 +3654,12 @@ static int process_one_request(struct drbd_connection *connection)
 				req->i.sector, req->i.size, (unsigned long)req);
 		what = err ? SEND_FAILED : HANDED_OVER_TO_NETWORK;
 	}
+	trace_drbd_req_send(req, peer_device, n_more, err);
 
 	spin_lock_irq(&connection->resource->req_lock);
 	__req_mod(req, what, peer_device, &m);
+	for (i = 0; i < n_more; i++)
+		__req_mod(more[i], what, peer_device, &more_m[i]);
 
 	/* As we hold the request lock anyways here,
 	 * this is a convenient place to check for new things to do. */
@@ -2642,6 +3669,10 @@ static int process_one_request(struct drbd_connection *connection)
 
 	if (m.bio)
 		complete_master_bio(device, &m);
+	for (i = 0; i < n_more; i++) {
+		if (more_m[i].bio)
+			complete_master_bio(device, &more_m[i]);
+	}
 
 	do_send_unplug = do_send_unplug && what == HANDED_OVER_TO_NETWORK;
 	maybe_send_unplug_remote(connection, do_send_unplug);
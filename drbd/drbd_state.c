@@ -949,6 +949,12 @@ static void set_resync_susp_other_c(struct drbd_peer_device *peer_device, bool v
 			if (p == peer_device)
 				continue;
 
+			/* Up-to-date peers may serve the resync together */
+			if (drbd_multi_source_resync &&
+			    peer_device->disk_state[NEW] == D_UP_TO_DATE &&
+			    p->disk_state[NEW] == D_UP_TO_DATE)
+				continue;
+
 			r = p->repl_state[NEW];
 			p->resync_susp_other_c[NEW] = true;
 
@@ -1994,6 +2000,7 @@ static void set_ov_position(struct drbd_peer_device *peer_device,
 		 * implicitly in receive_DataRequest once the
 		 * first P_OV_REQUEST is received */
 		peer_device->ov_start_sector = ~(sector_t)0;
+		peer_device->ov_tree = false;
 	} else {
 		unsigned long bit = BM_SECT_TO_BIT(peer_device->ov_start_sector);
 		if (bit >= peer_device->rs_total) {
@@ -2003,7 +2010,13 @@ static void set_ov_position(struct drbd_peer_device *peer_device,
 		} else
 			peer_device->rs_total -= bit;
 		peer_device->ov_position = peer_device->ov_start_sector;
+		peer_device->ov_tree = drbd_verify_tree &&
+			peer_device->connection->agreed_features & DRBD_FF_OV_TREE;
 	}
+	peer_device->ov_tree_pending = 0;
+	peer_device->ov_tree_credit = 0;
+	peer_device->ov_descend_head = 0;
+	peer_device->ov_descend_tail = 0;
 	peer_device->ov_left = peer_device->rs_total;
 }
 
@@ -2369,6 +2382,9 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 			idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 				clear_bit(INITIAL_STATE_SENT, &peer_device->flags);
 				clear_bit(INITIAL_STATE_RECEIVED, &peer_device->flags);
+				clear_bit(RS_CO_SOURCE_LEFT, &peer_device->flags);
+				peer_device->device->rs_co_sources_done &=
+					~NODE_MASK(peer_device->node_id);
 			}
 		}
 
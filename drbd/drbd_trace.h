@@ -0,0 +1,218 @@
+/*
+   drbd_trace.h
+
+   This file is part of DRBD.
+
+   Static tracepoints along the life cycle of application requests on the
+   primary (struct drbd_request) and of peer requests on the secondary
+   (struct drbd_peer_request).
+
+   Requests are identified by their address, which is also the block_id
+   the peer echoes back in its acks, and by dagtag_sector, which is the same
+   number on both nodes.  That allows to correlate a write on the primary
+   with its peer request on the secondary.
+
+   DRBD is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   DRBD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with drbd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM drbd
+
+#if !defined(_DRBD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DRBD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "drbd_int.h"
+
+TRACE_EVENT(drbd_req_new,
+	TP_PROTO(struct drbd_request *req),
+	TP_ARGS(req),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(void *, req)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(unsigned int, local_rq_state)
+	),
+
+	TP_fast_assign(
+		__entry->minor = req->device->minor;
+		__entry->req = req;
+		__entry->sector = req->i.sector;
+		__entry->size = req->i.size;
+		__entry->local_rq_state = req->local_rq_state;
+	),
+
+	TP_printk("minor=%u req=%p sector=%llu size=%u local=0x%x",
+		  __entry->minor, __entry->req,
+		  (unsigned long long)__entry->sector, __entry->size,
+		  __entry->local_rq_state)
+);
+
+/* Every change of the local or per peer state bits, see mod_rq_state().
+ * node_id is -1 for changes to local state only. */
+TRACE_EVENT(drbd_req_state,
+	TP_PROTO(struct drbd_request *req, int node_id,
+		 unsigned int old_local, unsigned int old_net),
+	TP_ARGS(req, node_id, old_local, old_net),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(void *, req)
+		__field(u64, dagtag_sector)
+		__field(int, node_id)
+		__field(unsigned int, old_local)
+		__field(unsigned int, new_local)
+		__field(unsigned int, old_net)
+		__field(unsigned int, new_net)
+	),
+
+	TP_fast_assign(
+		__entry->minor = req->device->minor;
+		__entry->req = req;
+		__entry->dagtag_sector = req->dagtag_sector;
+		__entry->node_id = node_id;
+		__entry->old_local = old_local;
+		__entry->new_local = req->local_rq_state;
+		__entry->old_net = old_net;
+		__entry->new_net = node_id == -1 ? 0 : req->net_rq_state[node_id];
+	),
+
+	TP_printk("minor=%u req=%p dagtag=%llu node=%d local=0x%x->0x%x net=0x%x->0x%x",
+		  __entry->minor, __entry->req,
+		  (unsigned long long)__entry->dagtag_sector, __entry->node_id,
+		  __entry->old_local, __entry->new_local,
+		  __entry->old_net, __entry->new_net)
+);
+
+/* The sender handed a request (and n_more coalesced ones) to the transport */
+TRACE_EVENT(drbd_req_send,
+	TP_PROTO(struct drbd_request *req, struct drbd_peer_device *peer_device,
+		 int n_more, int err),
+	TP_ARGS(req, peer_device, n_more, err),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(void *, req)
+		__field(u64, dagtag_sector)
+		__field(int, node_id)
+		__field(int, n_more)
+		__field(int, err)
+	),
+
+	TP_fast_assign(
+		__entry->minor = req->device->minor;
+		__entry->req = req;
+		__entry->dagtag_sector = req->dagtag_sector;
+		__entry->node_id = peer_device->node_id;
+		__entry->n_more = n_more;
+		__entry->err = err;
+	),
+
+	TP_printk("minor=%u req=%p dagtag=%llu node=%d coalesced=%d err=%d",
+		  __entry->minor, __entry->req,
+		  (unsigned long long)__entry->dagtag_sector, __entry->node_id,
+		  __entry->n_more, __entry->err)
+);
+
+/* An ack or nack from the peer was matched to this request */
+TRACE_EVENT(drbd_req_ack,
+	TP_PROTO(struct drbd_request *req, struct drbd_peer_device *peer_device,
+		 int what),
+	TP_ARGS(req, peer_device, what),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(void *, req)
+		__field(u64, dagtag_sector)
+		__field(int, node_id)
+		__field(int, what)
+	),
+
+	TP_fast_assign(
+		__entry->minor = req->device->minor;
+		__entry->req = req;
+		__entry->dagtag_sector = req->dagtag_sector;
+		__entry->node_id = peer_device->node_id;
+		__entry->what = what;
+	),
+
+	TP_printk("minor=%u req=%p dagtag=%llu node=%d what=%d",
+		  __entry->minor, __entry->req,
+		  (unsigned long long)__entry->dagtag_sector, __entry->node_id,
+		  __entry->what)
+);
+
+DECLARE_EVENT_CLASS(drbd_peer_req_class,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, node_id)
+		__field(void *, peer_req)
+		__field(u64, block_id)
+		__field(u64, dagtag_sector)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(unsigned long, flags)
+	),
+
+	TP_fast_assign(
+		__entry->minor = peer_req->peer_device->device->minor;
+		__entry->node_id = peer_req->peer_device->node_id;
+		__entry->peer_req = peer_req;
+		__entry->block_id = peer_req->block_id;
+		__entry->dagtag_sector = peer_req->dagtag_sector;
+		__entry->sector = peer_req->i.sector;
+		__entry->size = peer_req->i.size;
+		__entry->flags = peer_req->flags;
+	),
+
+	TP_printk("minor=%u node=%d peer_req=%p block_id=%llx dagtag=%llu sector=%llu size=%u flags=0x%lx",
+		  __entry->minor, __entry->node_id, __entry->peer_req,
+		  (unsigned long long)__entry->block_id,
+		  (unsigned long long)__entry->dagtag_sector,
+		  (unsigned long long)__entry->sector, __entry->size,
+		  __entry->flags)
+);
+
+/* P_DATA received, see receive_Data() */
+DEFINE_EVENT(drbd_peer_req_class, drbd_peer_req_receive,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req)
+);
+
+/* handed to the backing device, see drbd_submit_peer_request() */
+DEFINE_EVENT(drbd_peer_req_class, drbd_peer_req_submit,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req)
+);
+
+/* write to the backing device completed, see drbd_endio_write_sec_final() */
+DEFINE_EVENT(drbd_peer_req_class, drbd_peer_req_done,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req)
+);
+
+#endif /* _DRBD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE drbd_trace
+#include <trace/define_trace.h>
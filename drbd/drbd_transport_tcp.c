@@ -27,6 +27,8 @@
 #include <linux/sched/signal.h>
 #include <linux/net.h>
 #include <linux/tcp.h>
+#include <net/tcp.h>
+#include <linux/poison.h>
 #include <linux/highmem.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd_config.h>
@@ -42,11 +44,38 @@ MODULE_DESCRIPTION("TCP (SDP, SSOCKS) transport layer for DRBD");
 MODULE_LICENSE("GPL");
 MODULE_VERSION(REL_VERSION);
 
+/* Receive replicated data by taking over the pages of received skbs,
+ * where they line up with the pages of the peer request, instead of
+ * copying the data out of them. */
+static bool zerocopy_receive;
+MODULE_PARM_DESC(zerocopy_receive, "Take over received pages for write payloads instead of copying (kernel 5.14 and later)");
+module_param(zerocopy_receive, bool, 0644);
+
+/* Receive the data stream in large chunks into a read ahead buffer, and hand
+ * out packet headers and small payloads from there, so that a series of small
+ * packets costs one recvmsg() instead of several per packet.  Bulk payloads
+ * take what is buffered and receive the rest directly into their pages. */
+static bool recv_readahead;
+MODULE_PARM_DESC(recv_readahead, "Receive the data stream in chunks of up to 64KiB and hand out headers and small payloads from them");
+module_param(recv_readahead, bool, 0644);
+
+#define DTT_RA_ORDER	4
+#define DTT_RA_SIZE	(PAGE_SIZE << DTT_RA_ORDER)
+
 struct buffer {
 	void *base;
 	void *pos;
 };
 
+struct dtt_readahead {
+	void *base;		/* allocated on first use */
+	bool on;		/* decided at connect time */
+	unsigned int start;	/* first byte not handed out yet */
+	unsigned int end;	/* behind the last byte received */
+	unsigned long fills;	/* recvmsg() calls into the buffer */
+	unsigned long hits;	/* requests served without a recvmsg() */
+};
+
 #define DTT_CONNECTING 1
 
 struct drbd_tcp_transport {
@@ -55,6 +84,9 @@ struct drbd_tcp_transport {
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	struct dtt_readahead ra;	/* of the data stream */
+	unsigned long zc_pages_taken;	/* by dtt_recv_pages_zc() */
+	unsigned long zc_pages_copied;
 };
 
 struct dtt_listener {
@@ -216,6 +248,9 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 			tcp_transport->stream[i] = NULL;
 		}
 	}
+	tcp_transport->ra.on = false;
+	tcp_transport->ra.start = 0;
+	tcp_transport->ra.end = 0;
 
 	for_each_path_ref(drbd_path, transport) {
 		bool was_established = drbd_path->established;
@@ -231,6 +266,10 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 			free_page((unsigned long)tcp_transport->rbuf[i].base);
 			tcp_transport->rbuf[i].base = NULL;
 		}
+		if (tcp_transport->ra.base) {
+			free_pages((unsigned long)tcp_transport->ra.base, DTT_RA_ORDER);
+			tcp_transport->ra.base = NULL;
+		}
 		spin_lock(&tcp_transport->paths_lock);
 		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
 			list_del_init(&drbd_path->list);
@@ -310,6 +349,131 @@ static int dtt_recv_short(struct socket *socket, void *buf, size_t size, int fla
 	return kernel_recvmsg(socket, &msg, &iov, 1, size, msg.msg_flags);
 }
 
+static unsigned int dtt_ra_avail(struct dtt_readahead *ra)
+{
+	return ra->end - ra->start;
+}
+
+/* Hands out up to @size buffered bytes by copying them to @buf */
+static unsigned int dtt_ra_copy(struct dtt_readahead *ra, void *buf, size_t size)
+{
+	unsigned int n = min_t(size_t, dtt_ra_avail(ra), size);
+
+	memcpy(buf, ra->base + ra->start, n);
+	ra->start += n;
+	return n;
+}
+
+/* Receive until at least @size bytes are buffered, taking as much as the
+ * socket has and the buffer holds.  With MSG_DONTWAIT in @flags only what
+ * is there already.  Returns the result of the last recvmsg(). */
+static int dtt_ra_fill(struct dtt_readahead *ra, struct socket *socket, size_t size, int flags)
+{
+	int rv = 0;
+
+	while (dtt_ra_avail(ra) < size) {
+		struct kvec iov = {
+			.iov_base = ra->base + ra->end,
+			.iov_len = DTT_RA_SIZE - ra->end,
+		};
+		struct msghdr msg = {
+			.msg_flags = MSG_NOSIGNAL | (flags & MSG_DONTWAIT)
+		};
+
+		rv = kernel_recvmsg(socket, &msg, &iov, 1, iov.iov_len, msg.msg_flags);
+		if (rv <= 0)
+			break;
+		ra->end += rv;
+		ra->fills++;
+		if (flags & MSG_DONTWAIT)
+			break;
+	}
+	return rv;
+}
+
+static bool dtt_ra_aliases(struct dtt_readahead *ra, void *buf)
+{
+	return buf >= ra->base && buf < ra->base + DTT_RA_SIZE;
+}
+
+/* dtt_recv() for the data stream with read ahead.  As with rbuf, the returned
+ * buffer stays valid until the next call without CALLER_BUFFER, and has room
+ * for PAGE_SIZE bytes.  Callers receive the payload of a packet into the
+ * buffer returned for its header; such a read must neither move nor refill
+ * the buffer, as that would overwrite what is buffered of later packets. */
+static int dtt_recv_ra(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+		       void **buf, size_t size, int flags)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct dtt_readahead *ra = &tcp_transport->ra;
+	unsigned int n;
+	int rv;
+
+	if ((flags & CALLER_BUFFER) && dtt_ra_aliases(ra, *buf)) {
+		/* only consumed bytes may get overwritten */
+		TR_ASSERT(transport, *buf <= ra->base + ra->start);
+		TR_ASSERT(transport, *buf + size <= ra->base + DTT_RA_SIZE);
+		n = min_t(size_t, dtt_ra_avail(ra), size);
+		memmove(*buf, ra->base + ra->start, n);
+		ra->start += n;
+		if (n == size)
+			return n;
+		/* the buffer is empty now, receive the rest directly */
+		rv = dtt_recv_short(socket, *buf + n, size - n, flags & ~CALLER_BUFFER);
+		return rv > 0 ? n + rv : rv;
+	}
+
+	/* Bulk, or no room to append to the buffer: receive what is not
+	 * buffered directly.  Like with rbuf, reads into a caller buffer
+	 * leave the last returned buffer alone. */
+	if ((flags & CALLER_BUFFER) &&
+	    (size > PAGE_SIZE || DTT_RA_SIZE - ra->end < size - min_t(size_t, dtt_ra_avail(ra), size))) {
+		n = dtt_ra_copy(ra, *buf, size);
+		if (n == size)
+			return n;
+		rv = dtt_recv_short(socket, *buf + n, size - n, flags & ~CALLER_BUFFER);
+		return rv > 0 ? n + rv : rv;
+	}
+
+	TR_ASSERT(transport, size <= PAGE_SIZE);
+	if (!(flags & (CALLER_BUFFER | GROW_BUFFER)) && ra->start + PAGE_SIZE > DTT_RA_SIZE) {
+		/* keep room for a payload behind the returned buffer */
+		n = dtt_ra_avail(ra);
+		memmove(ra->base, ra->base + ra->start, n);
+		ra->start = 0;
+		ra->end = n;
+	}
+	if (dtt_ra_avail(ra) >= size) {
+		ra->hits++;
+	} else {
+		if (flags & GROW_BUFFER) {
+			/* appends to what the last, short call returned, which
+			 * emptied the buffer after moving it to the front */
+			TR_ASSERT(transport, *buf >= ra->base && *buf <= ra->base + ra->start);
+			TR_ASSERT(transport, ra->start + size <= DTT_RA_SIZE);
+		} else if (!(flags & CALLER_BUFFER)) {
+			n = dtt_ra_avail(ra);
+			memmove(ra->base, ra->base + ra->start, n);
+			ra->start = 0;
+			ra->end = n;
+		}
+
+		rv = dtt_ra_fill(ra, socket, size, flags & ~(CALLER_BUFFER | GROW_BUFFER));
+		/* like MSG_WAITALL; without waiting, a short read is fine */
+		if (dtt_ra_avail(ra) < size &&
+		    !((flags & MSG_DONTWAIT) && dtt_ra_avail(ra)))
+			return rv < 0 ? rv : 0;
+	}
+
+	n = min_t(size_t, dtt_ra_avail(ra), size);
+	if (flags & CALLER_BUFFER)
+		memcpy(*buf, ra->base + ra->start, n);
+	else if (!(flags & GROW_BUFFER))
+		*buf = ra->base + ra->start;
+	ra->start += n;
+	return n;
+}
+
 static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -321,6 +485,9 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	if (!socket)
 		return -ENOTCONN;
 
+	if (stream == DATA_STREAM && tcp_transport->ra.on)
+		return dtt_recv_ra(tcp_transport, socket, buf, size, flags);
+
 	if (flags & CALLER_BUFFER) {
 		buffer = *buf;
 		rv = dtt_recv_short(socket, buffer, size, flags & ~CALLER_BUFFER);
@@ -344,26 +511,276 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	return rv;
 }
 
+#define DTT_ZC_MAX_TAKEN	16
+
+struct dtt_zc_recv {
+	struct drbd_tcp_transport *tcp_transport;
+	struct drbd_page_chain_head *chain;
+	struct page *page;	/* currently filled */
+	unsigned int page_len;	/* bytes that go into page */
+	unsigned int fill;	/* bytes already in page */
+	size_t left;		/* bytes still to receive, including page */
+	/* skb pages taken over, linked into the chain in place of the pool
+	 * page "old" by dtt_zc_link_taken(), once the skb is gone */
+	unsigned int nr_taken;
+	struct {
+		struct page *old;
+		struct page *new;
+	} taken[DTT_ZC_MAX_TAKEN];
+};
+
+/* Pages of a page_pool keep the pool's state in the fields we use for the
+ * page chain, and go back to their pool, not to the page allocator.  Only
+ * since 5.14 can they be told from other pages (skb->pp_recycle, pp_magic);
+ * on older kernels, received pages are always copied. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+#define DTT_ZC_TAKE_PAGES
+#endif
+
+#ifdef DTT_ZC_TAKE_PAGES
+/* A page of a received skb can be linked into our page chain only if nobody
+ * but the skb holds a reference to it, and if it will not be looked at by the
+ * network stack again.  Once the skb is freed, the page is ours. */
+static bool dtt_page_takeable(struct sk_buff *skb, struct page *page)
+{
+	if (skb->pp_recycle || (page->pp_magic & ~0x3UL) == PP_SIGNATURE)
+		return false;
+	return !skb_cloned(skb) && !skb_has_shared_frag(skb) &&
+		!PageCompound(page) && !page_is_pfmemalloc(page) &&
+		!page->mapping && page_ref_count(page) == 1;
+}
+#endif
+
+/* Returns true if the next zc->page_len bytes at @offset of @skb are exactly
+ * one page fragment, starting at the beginning of its page, which we can
+ * take over in place of zc->page.  Only for skbs this read consumes entirely
+ * (@eaten): tcp_read_sock() lets go of those before it returns, and only
+ * then the page is touched, see dtt_zc_link_taken(). */
+static bool dtt_zc_take_frag(struct dtt_zc_recv *zc, struct sk_buff *skb,
+			     unsigned int offset, size_t len, bool eaten)
+{
+#ifdef DTT_ZC_TAKE_PAGES
+	unsigned int start = skb_headlen(skb);
+	struct page *page;
+	int i;
+
+	if (!eaten || zc->fill || len < zc->page_len || offset < start ||
+	    zc->nr_taken == DTT_ZC_MAX_TAKEN)
+		return false;
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		unsigned int frag_size = skb_frag_size(frag);
+
+		if (offset >= start + frag_size) {
+			start += frag_size;
+			continue;
+		}
+		if (offset != start || skb_frag_off(frag) != 0 || frag_size != zc->page_len)
+			return false;
+
+		page = skb_frag_page(frag);
+		if (!dtt_page_takeable(skb, page))
+			return false;
+
+		get_page(page);
+		zc->taken[zc->nr_taken].old = zc->page;
+		zc->taken[zc->nr_taken].new = page;
+		zc->nr_taken++;
+		zc->tcp_transport->zc_pages_taken++;
+		return true;
+	}
+#endif
+	return false;
+}
+
+/* Replace the pool pages by the skb pages taken over in their place.  The
+ * pool pages go back to the system, the taken ones are accounted in their
+ * place and later end up in our pool.  If the read failed, the skbs may
+ * still be around; then drop the taken pages instead.  If the skb is not
+ * freed yet (deferred), copy the data over to the pool page after all. */
+static void dtt_zc_link_taken(struct dtt_zc_recv *zc, bool ok)
+{
+	struct page *prev = NULL, *page = zc->chain->head;
+	unsigned int i = 0;
+
+	while (page && i < zc->nr_taken) {
+		struct page *next = page_chain_next(page);
+		struct page *old = zc->taken[i].old, *new = zc->taken[i].new;
+
+		if (page != old) {
+			prev = page;
+			page = next;
+			continue;
+		}
+		i++;
+		if (!ok || page_ref_count(new) != 1) {
+			if (ok) {
+				void *to = kmap(old), *from = kmap(new);
+
+				memcpy(to, from, page_chain_size(old));
+				kunmap(new);
+				kunmap(old);
+				zc->tcp_transport->zc_pages_copied++;
+			}
+			zc->tcp_transport->zc_pages_taken--;
+			put_page(new);
+			prev = page;
+			page = next;
+			continue;
+		}
+		set_page_chain_next_offset_size(new, next, 0, page_chain_size(old));
+		if (prev)
+			set_page_chain_next(prev, new);
+		else
+			zc->chain->head = new;
+		set_page_chain_next_offset_size(old, NULL, 0, 0);
+		put_page(old);
+		prev = new;
+		page = next;
+	}
+	zc->nr_taken = 0;
+}
+
+static int dtt_zc_recv_actor(read_descriptor_t *desc, struct sk_buff *skb,
+			     unsigned int offset, size_t len)
+{
+	struct dtt_zc_recv *zc = desc->arg.data;
+	bool eaten = desc->count >= len;
+	size_t consumed = 0;
+
+	len = min(len, desc->count);
+	while (consumed < len) {
+		unsigned int n;
+
+		if (dtt_zc_take_frag(zc, skb, offset + consumed, len - consumed, eaten)) {
+			n = zc->page_len;
+		} else {
+			void *data;
+			int err;
+
+			n = min_t(size_t, zc->page_len - zc->fill, len - consumed);
+			data = kmap(zc->page);
+			err = skb_copy_bits(skb, offset + consumed, data + zc->fill, n);
+			kunmap(zc->page);
+			if (err) {
+				desc->error = err;
+				break;
+			}
+			if (!zc->fill)
+				zc->tcp_transport->zc_pages_copied++;
+		}
+		zc->fill += n;
+		zc->left -= n;
+		consumed += n;
+
+		if (zc->fill == zc->page_len) {
+			set_page_chain_offset(zc->page, 0);
+			set_page_chain_size(zc->page, zc->page_len);
+			zc->page = page_chain_next(zc->page);
+			zc->page_len = min_t(size_t, zc->left, PAGE_SIZE);
+			zc->fill = 0;
+		}
+	}
+	desc->count -= consumed;
+	return consumed;
+}
+
+/* Like the copying loop in dtt_recv_pages(), with the semantics of
+ * MSG_WAITALL and the receive timeout of the socket, but reading
+ * directly from the receive queue with tcp_read_sock(). */
+static int dtt_recv_pages_zc(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+			     struct drbd_page_chain_head *chain, size_t size)
+{
+	struct sock *sk = socket->sk;
+	struct dtt_zc_recv zc = {
+		.tcp_transport = tcp_transport,
+		.chain = chain,
+		.page = chain->head,
+		.page_len = min_t(size_t, size, PAGE_SIZE),
+		.left = size,
+	};
+	read_descriptor_t desc = {
+		.arg.data = &zc,
+		.count = size,
+	};
+	long timeo = sk->sk_rcvtimeo;
+	int err = 0;
+
+	lock_sock(sk);
+	while (desc.count) {
+		int rv = tcp_read_sock(sk, &desc, dtt_zc_recv_actor);
+
+		dtt_zc_link_taken(&zc, !desc.error && rv >= 0);
+		if (desc.error) {
+			err = desc.error;
+			break;
+		}
+		if (rv < 0) {
+			err = rv;
+			break;
+		}
+		if (!desc.count)
+			break;
+		if (sk->sk_err) {
+			err = sock_error(sk);
+			break;
+		}
+		if (sk->sk_shutdown & RCV_SHUTDOWN) {
+			err = -ECONNRESET;
+			break;
+		}
+		if (!timeo) {
+			err = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)) {
+			err = sock_intr_errno(timeo);
+			break;
+		}
+		sk_wait_data(sk, &timeo, NULL);
+	}
+	release_sock(sk);
+
+	return err;
+}
+
 static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	/* may change at any time, the chain must fit the path we take */
+	bool zc = READ_ONCE(zerocopy_receive);
 	struct page *page;
 	int err;
 
 	if (!socket)
 		return -ENOTCONN;
 
-	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	/* The copying loop below can fill compound pages as well */
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE),
+			      zc ? GFP_TRY : GFP_TRY | __GFP_COMP);
 	page = chain->head;
 	if (!page)
 		return -ENOMEM;
 
+	/* tcp_read_sock() would skip what is still in the read ahead buffer */
+	if (zc && !dtt_ra_avail(&tcp_transport->ra)) {
+		err = dtt_recv_pages_zc(tcp_transport, socket, chain, size);
+		if (err)
+			goto fail;
+		return 0;
+	}
+
 	page_chain_for_each(page) {
-		size_t len = min_t(int, size, PAGE_SIZE);
+		size_t len = min_t(size_t, size, PAGE_SIZE << compound_order(page));
 		void *data = kmap(page);
-		err = dtt_recv_short(socket, data, len, 0);
+		unsigned int n = 0;
+
+		if (tcp_transport->ra.on)
+			n = dtt_ra_copy(&tcp_transport->ra, data, len);
+		err = n < len ? dtt_recv_short(socket, data + n, len - n, 0) : 0;
 		kunmap(page);
 		set_page_chain_offset(page, 0);
 		set_page_chain_size(page, len);
@@ -1066,6 +1483,13 @@ randomize:
 	tcp_transport->stream[DATA_STREAM] = dsocket;
 	tcp_transport->stream[CONTROL_STREAM] = csocket;
 
+	if (recv_readahead && !tcp_transport->ra.base)
+		tcp_transport->ra.base = (void *)__get_free_pages(GFP_KERNEL | __GFP_NOWARN,
+								  DTT_RA_ORDER);
+	tcp_transport->ra.start = 0;
+	tcp_transport->ra.end = 0;
+	tcp_transport->ra.on = recv_readahead && tcp_transport->ra.base;
+
 	rcu_read_lock();
 	nc = rcu_dereference(transport->net_conf);
 
@@ -1282,7 +1706,14 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 	enum drbd_stream i;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 2);
+
+	seq_printf(m, "zero-copy receive: %s\n", zerocopy_receive ? "on" : "off");
+	seq_printf(m, "received pages taken over: %lu\n", tcp_transport->zc_pages_taken);
+	seq_printf(m, "received pages copied: %lu\n", tcp_transport->zc_pages_copied);
+	seq_printf(m, "read ahead: %s\n", tcp_transport->ra.on ? "on" : "off");
+	seq_printf(m, "read ahead fills: %lu\n", tcp_transport->ra.fills);
+	seq_printf(m, "read ahead hits: %lu\n\n", tcp_transport->ra.hits);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
 		struct socket *socket = tcp_transport->stream[i];